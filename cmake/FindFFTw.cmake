@@ -14,13 +14,27 @@ find_path(FFTw_INCLUDE_DIR
 	PATHS ${FFTw_PKGCONF_INCLUDE_DIRS}
 )
 
-# Library
+# Library, double and long double precision
 find_library(FFTw_LIBRARY
 	NAMES fftw3
 	PATHS ${FFTw_PKGCONF_LIBRARY_DIRS}
 )
+find_library(FFTwl_LIBRARY
+	NAMES fftw3l
+	PATHS ${FFTw_PKGCONF_LIBRARY_DIRS}
+)
+
+# Threads, optional.
+find_library(FFTw_THREADS_LIBRARY
+	NAMES fftw3_omp fftw3_threads
+	PATHS ${FFTw_PKGCONF_LIBRARY_DIRS}
+)
+find_library(FFTwl_THREADS_LIBRARY
+	NAMES fftw3l_omp fftw3l_threads
+	PATHS ${FFTw_PKGCONF_LIBRARY_DIRS}
+)
 
 set(FFTw_PROCESS_INCLUDES  FFTw_INCLUDE_DIR)
-set(FFTw_PROCESS_LIBS  FFTw_LIBRARY)
+set(FFTw_PROCESS_LIBS  FFTw_LIBRARY FFTwl_LIBRARY)
 libfind_process(FFTw)
 
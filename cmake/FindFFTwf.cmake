@@ -20,6 +20,12 @@ find_library(FFTwf_LIBRARY
 	PATHS ${FFTwf_PKGCONF_LIBRARY_DIRS}
 )
 
+# Threads, optional: the OpenMP variant shares the threads of the caller.
+find_library(FFTwf_THREADS_LIBRARY
+	NAMES fftw3f_omp fftw3f_threads
+	PATHS ${FFTwf_PKGCONF_LIBRARY_DIRS}
+)
+
 set(FFTwf_PROCESS_INCLUDES  FFTwf_INCLUDE_DIR)
 set(FFTwf_PROCESS_LIBS  FFTwf_LIBRARY)
 libfind_process(FFTwf)
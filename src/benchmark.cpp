@@ -2,16 +2,36 @@
 #include <boost/program_options.hpp>
 #include "constraint_parser.h"
 
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 using namespace boost;
 using namespace boost::program_options;
 
-static bool run_cpu = false, run_gpu = false, profile = false;
+static bool run_cpu = false, run_gpu = false, run_double = false, run_long_double = false, run_sat = false, profile = false;
 static size_t runs = 10;
 
 typedef float T;
 
 
+// the benchmark parameters in precision U.
+template<class U>
+params<U> with_precision(const params<T> &p) {
+	params<U> q(p.size, p.kernel_sizes);
+	q.force_q = p.force_q;
+	q.input_stddev = p.input_stddev;
+	q.tolerance = p.tolerance;
+	q.check_every = p.check_every;
+	q.max_steps = p.max_steps;
+	std::istringstream desc(p.resolvent->desc());
+	desc >> std::noskipws >> q.resolvent;
+	return q;
+}
+
+
+template<class T>
 void run(params<T> p, multi_array<T,2> in) {
 	vex::stopwatch<> w;
 	auto prof = make_shared<vex::profiler<>>(vex::current_context().queue());
@@ -35,7 +55,17 @@ void run(params<T> p, multi_array<T,2> in) {
 }
 
 
-void bench(params<T> p, size_t image, size_t kernels) {
+// the CPU run in precision U.
+template<class U>
+void run_as(const params<T> &p) {
+	auto q = with_precision<U>(p);
+	multi_array<U, 2> in(p.size);
+	mimas::fill(in, 1);
+	run(q, in);
+}
+
+
+void bench(params<T> p, size_t image, size_t kernels, size_t threads) {
 	size2_t sz{{image, image}};
 	p.size = sz;
 	p.kernel_sizes.clear();
@@ -43,11 +73,21 @@ void bench(params<T> p, size_t image, size_t kernels) {
 		p.kernel_sizes.push_back(1);
 	multi_array<T, 2> in(extents[image][image]);
 	mimas::fill(in, 1);
-	cout << image << '\t' << kernels;
+#if HAVE_OPENMP
+	static const int cores = omp_get_max_threads();
+	omp_set_num_threads(threads > 0 ? threads : cores);
+#endif
+	cout << image << '\t' << kernels << '\t' << threads;
 	if(run_cpu) {
 		p.use_gpu = false;
 		p.use_fft = true;
 		run(p, in);
+		if(run_double) run_as<double>(p);
+		if(run_long_double) run_as<long double>(p);
+		if(run_sat) {
+			p.use_fft = false;
+			run(p, in);
+		}
 	}
 	if(run_gpu) {
 		p.use_gpu = true;
@@ -68,15 +108,19 @@ int main(int argc, char **argv) {
 	base_p.max_steps = 100;
 
 	options_description desc("Options");
-	sizes_t sizes{128}, kernels{4};
+	sizes_t sizes{128}, kernels{4}, threads{0};
 	desc.add_options()
 		("help,h", "show help")
 		("size,s", value(&sizes)->default_value(sizes), "list of sizes to try.")
 		("kernels,k", value(&kernels)->default_value(kernels), "list of kernel counts to try.")
+		("threads,t", value(&threads)->default_value(threads), "list of CPU thread counts to try, 0 for the default.")
 		("resolvent", value(&base_p.resolvent)->default_value(base_p.resolvent),
 				"Resolvent function to use, either “L2” for L₂ or “H1 <delta>” for H₁")
 		("gpu", bool_switch(&run_gpu), "use gpu")
 		("cpu", bool_switch(&run_cpu), "use cpu")
+		("double", bool_switch(&run_double), "also use cpu in double precision")
+		("long-double", bool_switch(&run_long_double), "also use cpu in long double precision")
+		("sat", bool_switch(&run_sat), "also use cpu with summed area tables")
 		("runs,r", value(&runs)->default_value(10), "number of runs to measure")
 		("profile,p", bool_switch(&profile), "create profile instead of benchmark");
 	variables_map vm;
@@ -92,15 +136,19 @@ int main(int argc, char **argv) {
 	cerr << "CL context:" << clctx << endl;
 
 	if(!profile) {
-		cout << "size\tkernels";
+		cout << "size\tkernels\tthreads";
 		if(run_cpu) cout << "\tcpu";
+		if(run_cpu && run_double) cout << "\tcpudouble";
+		if(run_cpu && run_long_double) cout << "\tcpulongdouble";
+		if(run_cpu && run_sat) cout << "\tcpusat";
 		if(run_gpu) cout << "\tgpu\tgpusat";
 		cout << endl;
 	}
 
 	for(auto w : sizes)
 		for(auto k : kernels)
-			bench(base_p, w, k);
+			for(auto t : threads)
+				bench(base_p, w, k, t);
 
 	return EXIT_SUCCESS;
 }
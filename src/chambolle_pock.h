@@ -10,11 +10,11 @@
 #include <iostream>
 
 #include <fstream>
-
-#include <boost/filesystem.hpp>
+#include <limits>
 
 #include "resolvent.h"
 #include "constraint_parser.h"
+#include "q_cache.h"
 
 
 /**
@@ -45,7 +45,37 @@ template<class T>
 struct params {
 	size_t max_steps = 2000, monte_carlo_steps = 1000;
 	T alpha = 0.5, tau = 1000, sigma = 1, input_stddev = -1, force_q = -1, tolerance = 1000;
+	// steps between the tolerance tests.
+	size_t check_every = 1;
+	// Monte Carlo samples for q are drawn from this stream, 0 for a random one.
+	size_t mc_seed = 0;
+	// if > 0, Monte Carlo samples for q run in batches until the relative
+	// half-width of the 95 % interval of q is below this, at most
+	// monte_carlo_steps of them.
+	T mc_tolerance = 0;
+	// simulated q are kept here, at most cache_limit MiB of them, 0 for no limit.
+	std::string cache_dir = "cache";
+	size_t cache_limit = 256;
 	bool no_cache = false, penalized_scan = false, dump_mc = false, use_fft = true, use_gpu = false;
+	// CPU only, without use_fft: running sums instead of a SAT.
+	bool use_separable = false;
+	// CPU only, with use_fft or use_hybrid: threads for each transform
+	// outside of the parallel loops, 0 for all cores. Inside them, e.g. in
+	// the simulation for q, each transform runs on one thread.
+	int fft_threads = 0;
+	// CPU only, with use_fft: overlap-save on tiles of this size, 0 for full frames.
+	size_t fft_tile = 0;
+	// CPU only, with use_fft: transform sizes with large prime factors padded
+	// to products of 2, 3, 5 and 7.
+	bool fft_pad = false;
+	// CPU only, with use_fft: transforms in place, the spectra share the
+	// buffer of the convolved images.
+	bool fft_in_place = false;
+	// CPU only: convolver for each kernel size from the calibrated costs.
+	bool use_hybrid = false;
+	// CPU with SAT only: the dual update in one pass over the rows. The
+	// other convolvers have no streamed pass, runner() refuses them.
+	bool stream_dual = false;
 	sizes_t kernel_sizes;
 	size2_t size;
 	std::shared_ptr<resolvent_params<T>> resolvent = std::make_shared<resolvent_l2_params<T>>();
@@ -87,71 +117,141 @@ struct impl {
 	}
 
 protected:
-	T cached_q(std::function<void(std::vector<std::vector<T>>&)> calc) {
+	/**
+	 * the (1 - alpha) quantile of the maxima over the kernels. calc(tail,
+	 * first, n) runs samples first .. first + n - 1 and hands each to
+	 * sample(); only the tail above the quantile is kept, and cached under
+	 * the parameters of the distribution and source, the convolver and
+	 * random numbers of the solver. A cached tail too short for alpha, or
+	 * of fewer than monte_carlo_steps samples and, with mc_tolerance, too
+	 * loose for it, is simulated again, by one process at a time.
+	 */
+	T cached_q(const std::string &source, std::function<void(top_k<T> &, size_t, size_t)> calc) {
 		using namespace std;
-		using namespace boost::filesystem;
 		if(p.force_q >= 0) return p.force_q;
 
-		// filename from kernel stack
-		ostringstream ss_desc;
-		ss_desc << p.size[0] << 'x' << p.size[1] << " box";
-		for(auto s : p.kernel_sizes) ss_desc << ' ' << s;
-		if(p.penalized_scan) ss_desc << " penalized";
-		const auto desc = ss_desc.str();
-		// use hash to avoid overlong file names
-		static const hash<string> hash_f;
-		const size_t id = hash_f(desc);
-
-		static const auto cache_dir = "cache/";
-		create_directories(cache_dir);
-		ostringstream ss_target;
-		ss_target << cache_dir << id << ".dat";
-		const auto target = ss_target.str();
-
-		vector<T> qs;
-		if(p.no_cache || !exists(target)) {
-			// simulate. k_qs[kernel][runs]
-			const size_t N = p.kernel_sizes.size(), M = p.monte_carlo_steps;
-			vector<vector<T>> k_qs;
-			for(size_t i = 0 ; i < N ; i++) k_qs.emplace_back();
-			calc(k_qs);
-			// print raw data
-			if(p.dump_mc) {
-				ofstream o("mc.dat");
-				for(size_t i = 0 ; i < N ; i++) {
-					if(i != 0) o << '\t';
-					o << p.kernel_sizes[i];
-				}
-				for(size_t j = 0 ; j < M ; j++)
-					for(size_t i = 0 ; i < N ; i++)
-						o << (i == 0 ? '\n' : '\t') << k_qs[i][j];
+		// everything the distribution depends on.
+		ostringstream ss_key;
+		ss_key << p.size[0] << 'x' << p.size[1] << " box";
+		for(auto s : p.kernel_sizes) ss_key << ' ' << s;
+		if(p.penalized_scan) ss_key << " penalized";
+		ss_key << ", value " << sizeof(T) << ' ' << numeric_limits<T>::digits << ", " << source;
+		const auto key = ss_key.str();
+		const q_cache cache(p.cache_dir, uintmax_t(p.cache_limit) << 20);
+
+		const double level = 1 - double(p.alpha);
+		const size_t M = p.monte_carlo_steps;
+		const bool adaptive = p.mc_tolerance > 0;
+		// read in place from the mapped file.
+		q_cache::view<T> mapped;
+		const auto cached = [&] {
+			const auto &t = mapped.tail;
+			return !p.no_cache && cache.load(key, mapped) && t.has(level)
+				&& (t.count >= M || (adaptive && tight(t, level)));
+		};
+		if(cached()) return mapped.tail.quantile(level);
+		// the others wait for this one, then read its result.
+		unique_ptr<q_cache::key_lock> lock;
+		if(!p.no_cache) lock.reset(new q_cache::key_lock(cache, key));
+		if(cached()) return mapped.tail.quantile(level);
+
+		// simulate, adaptively in batches growing with the samples,
+		// keeping the tail down to the interval at the budget.
+		const size_t N = p.kernel_sizes.size();
+		size_t k = top_k<T>::needed(level, M), lo, hi;
+		if(adaptive) k = top_k<T>::interval(level, M, lo, hi) ? max(k, M - lo) : M;
+		top_k<T> tail(k);
+		// print raw data
+		if(p.dump_mc) {
+			dump.reset(new std::ofstream("mc.dat"));
+			for(size_t i = 0 ; i < N ; i++)
+				*dump << (i == 0 ? "" : "\t") << p.kernel_sizes[i];
+			*dump << '\n';
+		}
+		for(size_t n = 0 ; n < M ; ) {
+			const size_t batch = adaptive ? min(M - n, max<size_t>(100, n / 4)) : M;
+			calc(tail, n, batch);
+			n += batch;
+			if(!adaptive) continue;
+			const auto v = tail.sorted();
+			const sorted_tail<T> sorted(v.data(), v.size(), tail.count);
+			T lo_q, hi_q;
+			if(quantile_interval(sorted, level, lo_q, hi_q)) {
+				ostringstream d;
+				d << "Monte Carlo simulation for q, " << n << " samples, q in [" << lo_q << ", " << hi_q << ']';
+				progress(double(n) / M, d.str());
 			}
-			// max for each kernel. qs[runs]
-			qs = k_qs[0];
-			for(size_t i = 1 ; i < N ; i++)
-				for(size_t j = 0 ; j < M ; j++)
-					qs[j] = max(qs[j], k_qs[i][j]);
-			sort(qs.begin(), qs.end());
-			// write raw output.
-			ofstream f(target);
-			f << "# " << desc << '\n';
-			for(auto x : qs) f << x << '\n';
-		} else {
-			// read
-			ifstream f(target);
-			string _desc; getline(f, _desc);
-			for(T value ; f >> value ; qs.push_back(value));
-			sort(qs.begin(), qs.end());
+			if(tight(sorted, level)) break;
 		}
+		dump.reset();
+		if(!tail.has(level)) throw invalid_argument("no Monte Carlo samples for q");
+		cache.store(key, tail);
 		// return (1 - alpha) quantile:
-		return qs[size_t((qs.size() - 1) * (1 - p.alpha))];
+		return tail.quantile(level);
+	}
+
+	// [lo, hi] = the interval of the quantile, if the tail holds it.
+	static bool quantile_interval(const sorted_tail<T> &tail, double level, T &lo, T &hi) {
+		size_t l, h;
+		if(!top_k<T>::interval(level, tail.count, l, h) || !tail.holds(l)) return false;
+		lo = tail.at(l);
+		hi = tail.at(h);
+		return true;
 	}
 
+	// whether the interval of the quantile is within mc_tolerance.
+	bool tight(const sorted_tail<T> &tail, double level) const {
+		T lo, hi;
+		return quantile_interval(tail, level, lo, hi)
+			&& (hi - lo) / 2 <= p.mc_tolerance * std::abs(tail.quantile(level));
+	}
+
+	/**
+	 * k_q[j], sample for kernel j, into the tail of the worker. Rows of the
+	 * raw data go out in the order they come.
+	 */
+	void sample(top_k<T> &tail, const std::vector<T> &k_q) {
+		tail.push(*std::max_element(k_q.begin(), k_q.end()));
+		if(dump) {
+			#pragma omp critical(impl_dump)
+			{
+				for(size_t j = 0 ; j < k_q.size() ; j++)
+					*dump << (j == 0 ? "" : "\t") << k_q[j];
+				*dump << '\n';
+			}
+		}
+	}
+
+private:
+	// raw data of the simulation with dump_mc.
+	std::unique_ptr<std::ostream> dump;
+
 };
 
 #include "chambolle_pock_cpu.h"
 #include "chambolle_pock_cl.h"
 
+template<class T>
+std::shared_ptr<impl<T>> gpu_runner(const params<T> &p) {
+	return std::make_shared<chambolle_pock_gpu<T>>(p);
+}
+
+// OpenCL has no long double.
+template<>
+inline std::shared_ptr<impl<long double>> gpu_runner(const params<long double> &) {
+	throw std::invalid_argument("no long double on the GPU");
+}
+
+// the CPU solver specialized for the resolvent, chosen once here.
+template<class T>
+std::shared_ptr<impl<T>> cpu_runner(const params<T> &p) {
+	if(dynamic_cast<const resolvent_l2_params<T> *>(p.resolvent.get()))
+		return std::make_shared<chambolle_pock_cpu<T, resolvent_l2_cpu<T>>>(p);
+	if(dynamic_cast<const resolvent_h1_params<T> *>(p.resolvent.get()))
+		return std::make_shared<chambolle_pock_cpu<T, resolvent_h1_cpu<T>>>(p);
+	return std::make_shared<chambolle_pock_cpu<T>>(p);
+}
+
 template<class T>
 std::shared_ptr<impl<T>> params<T>::runner() const {
 	// verify
@@ -160,9 +260,11 @@ std::shared_ptr<impl<T>> params<T>::runner() const {
 	const auto min_sz = std::min(size[0], size[1]);
 	for(auto k : kernel_sizes)
 		if(k < 1 || k > min_sz) throw std::invalid_argument("invalid kernel size");
+	if(stream_dual && (use_gpu || use_hybrid || use_fft || use_separable))
+		throw std::invalid_argument("streamed dual update only with the CPU SAT convolver");
 	// ok.
-	if(use_gpu) return std::make_shared<chambolle_pock_gpu<T>>(*this);
-	else return std::make_shared<chambolle_pock_cpu<T>>(*this);
+	if(use_gpu) return gpu_runner(*this);
+	else return cpu_runner(*this);
 }
 
 #endif
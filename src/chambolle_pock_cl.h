@@ -75,19 +75,21 @@ struct chambolle_pock_gpu : public impl<T> {
 
 	void calc_q() {
 		// If needed, calculate `q/sigma` value.
-		q = this->cached_q([&](std::vector<std::vector<T>> &k_qs){
+		std::random_device dev;
+		std::mt19937 seed(p.mc_seed ? p.mc_seed : dev());
+		q = this->cached_q(p.use_fft ? "gpu vexcl normal mt19937, fft" : "gpu vexcl normal mt19937, sat",
+				[&](top_k<T> &tail, size_t first, size_t n){
 			A data(size_1d), convolved(size_1d);
+			std::vector<T> k_q(constraints.size());
 			vex::RandomNormal<T> random;
-			std::random_device dev;
-			std::mt19937 seed(dev());
-			for(size_t i = 0 ; i < p.monte_carlo_steps ; i++) {
+			for(size_t i = first ; i < first + n ; i++) {
 				data = random(vex::element_index(), seed());
 				auto f_data = convolution->prepare_image(data);
 				for(size_t j = 0 ; j < constraints.size() ; j++) {
-					convolution->conv(f_data, constraints[j].k, convolved);
-					auto k_q = norm_inf(convolved) - constraints[j].shift_q;
-					k_qs[j].push_back(k_q);
+					convolution->conv(*f_data, *constraints[j].k, convolved);
+					k_q[j] = norm_inf(convolved) - constraints[j].shift_q;
 				}
+				this->sample(tail, k_q);
 				if(i % 10 == 0) this->progress(double(i) / p.monte_carlo_steps, "Monte Carlo simulation for q");
 			}
 		});
@@ -186,7 +188,7 @@ struct chambolle_pock_gpu : public impl<T> {
 				auto &c = constraints[i];
 				// convolve bar_x with kernel
 				profile_push("(c) k * bar_x");
-					convolution->conv(f_bar_x, c.k, convolved);
+					convolution->conv(*f_bar_x, *c.k, convolved);
 				profile_pop();
 				debug(convolved, str(boost::format("convolved_%d") % i));
 				// calculate new y_i
@@ -203,7 +205,7 @@ struct chambolle_pock_gpu : public impl<T> {
 					const auto f_y = convolution->prepare_image(c.y);
 				profile_pop();
 				profile_push("(f) adj_k * y");
-					convolution->conv(f_y, c.adj_k, convolved);
+					convolution->conv(*f_y, *c.adj_k, convolved);
 				profile_pop();
 				debug(convolved, str(boost::format("adj_convolved_%d") % i));
 				// accumulate
@@ -237,7 +239,7 @@ struct chambolle_pock_gpu : public impl<T> {
 
 			if(!current(out, n)) break;
 
-			if(n > 1 && p.tolerance > 0) {
+			if(n > 1 && p.tolerance > 0 && n % std::max<size_t>(p.check_every, 1) == 0) {
 				const T ch = norm_1(x) / norm_1(x - old_x);
 				if(ch >= p.tolerance) break;
 			}
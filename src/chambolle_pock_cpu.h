@@ -2,11 +2,14 @@
 #define __CHAMBOLLE_POCK_CPU_H__
 
 #include <boost/format.hpp>
+#include <random>
 
 #include "chambolle_pock.h"
 #include "resolvent.h"
 #include "convolution.h"
+#include "hybrid_convolver.h"
 #include "image_variance.h"
+#include "philox.h"
 
 
 #if HAVE_OPENMP
@@ -15,9 +18,12 @@
 
 
 
-template<class T>
+// R is the resolvent, or resolvent_cpu<T> for any of them. Known ones
+// are called directly, L2 is folded into the primal update.
+template<class T, class R = resolvent_cpu<T>>
 struct chambolle_pock_cpu : public impl<T> {
 	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T, 3> B;
 
 	using impl<T>::p;
 	using impl<T>::input_stddev;
@@ -27,73 +33,114 @@ struct chambolle_pock_cpu : public impl<T> {
 		// size of the box kernel.
 		size_t k_size;
 		std::shared_ptr<prepared_kernel> k, adj_k;
-		// y for this constraint
-		A y;
 		// specific q for this constraint.
 		T q, shift_q;
 
-		constraint(size_t k_size, size2_t size,
+		constraint(size_t k_size,
 			std::shared_ptr<prepared_kernel> k, std::shared_ptr<prepared_kernel> adj_k)
-		: k_size(k_size), k(k), adj_k(adj_k), y(size), q(-1), shift_q(0) {}
+		: k_size(k_size), k(k), adj_k(adj_k), q(-1), shift_q(0) {}
 	};
 
 	T total_norm;
 	std::vector<constraint> constraints;
-	std::shared_ptr<resolvent_cpu<T>> resolv;
+	// kernels of all constraints, for batched convolutions.
+	std::vector<std::shared_ptr<prepared_kernel>> ks, adj_ks;
+	// y_i for all constraints.
+	B ys;
+	std::shared_ptr<R> resolv;
 	std::shared_ptr<cpu_convolver<T>> convolution;
+	// scratch arrays of the convolutions, kept for all iterations.
+	std::shared_ptr<workspace> work;
 	bool initialized = false;
+	// threads for each transform outside of the parallel loops.
+	int fft_threads = 1;
 
 	chambolle_pock_cpu(const params<T> &p)
 	: impl<T>(p),
-	  resolv(p.resolvent->cpu_runner(p.size)) {
-		if(p.use_fft) convolution = std::make_shared<cpu_fft_convolver<T>>(p.size);
-		else convolution = std::make_shared<cpu_sat_convolver<T>>(p.size);
+	  resolv(std::dynamic_pointer_cast<R>(p.resolvent->cpu_runner(p.size))) {
+		if(!resolv) throw std::logic_error("resolvent of the wrong type");
 #if HAVE_OPENMP
 		if(this->profiler)
 			omp_set_num_threads(1);
+		fft_threads = p.fft_threads > 0 ? p.fft_threads : omp_get_max_threads();
+#else
+		if(p.fft_threads > 0) fft_threads = p.fft_threads;
 #endif
+		if(p.use_hybrid) convolution = std::make_shared<hybrid_convolver<T>>(p.size, fft_threads);
+		else if(p.use_fft && p.fft_tile > 0) convolution = std::make_shared<cpu_tiled_fft_convolver<T>>(p.size, p.fft_tile);
+		else if(p.use_fft) convolution = std::make_shared<cpu_fft_convolver<T>>(p.size, fft_threads,
+			p.fft_pad ? *std::max_element(p.kernel_sizes.begin(), p.kernel_sizes.end()) : 0, p.fft_in_place);
+		else if(p.use_separable) convolution = std::make_shared<cpu_separable_box_convolver<T>>(p.size);
+		else convolution = std::make_shared<cpu_sat_convolver<T, typename accumulator_of<T>::type>>(p.size);
 	}
 
 	void update_kernels() {
 		constraints.clear();
+		ks.clear();
+		adj_ks.clear();
 		total_norm = 0;
+		work = std::make_shared<workspace>();
+		convolution->use_workspace(work);
+		convolution->plan(p.kernel_sizes);
 		for(auto k_size : p.kernel_sizes) {
 			auto prep_k = convolution->prepare_kernel(k_size, false);
 			auto adj_prep_k = convolution->prepare_kernel(k_size, true);
-			constraints.emplace_back(k_size, p.size, prep_k, adj_prep_k);
+			constraints.emplace_back(k_size, prep_k, adj_prep_k);
+			ks.push_back(prep_k);
+			adj_ks.push_back(adj_prep_k);
 			total_norm += k_size * k_size / 2;
 		}
+		ys.resize(boost::extents[constraints.size()][p.size[0]][p.size[1]]);
 		if(p.penalized_scan)
 			for(auto &c : constraints)
 				c.shift_q = sqrt(log(1.0 * p.size[0] * p.size[1] / pow(c.k_size, 2)));
 		calc_q();
 	}
 
+	// random numbers and convolver of the simulation for q, for its cache.
+	std::string mc_source() const {
+		std::ostringstream s;
+		s << "cpu philox4x32-10 box-muller, ";
+		if(p.use_hybrid) s << "hybrid";
+		else if(p.use_fft && p.fft_tile > 0) s << "fft tile " << p.fft_tile;
+		else if(p.use_fft) s << (p.fft_pad ? "fft padded" : "fft");
+		else if(p.use_separable) s << "separable";
+		else s << "sat " << sizeof(typename accumulator_of<T>::type);
+		return s.str();
+	}
+
+	// sample i is drawn from counter i of the seed's stream, each thread
+	// keeps the tail of its samples, merged at the end of the batch, the
+	// same for any number of threads.
 	void calc_q() {
 		using namespace mimas;
-		using namespace std;
-		q = this->cached_q([&](std::vector<std::vector<T>> &k_qs){
-			random_device dev;
-			const size_t seed = dev();
-			#pragma omp parallel for
-			for(size_t i = 0 ; i < p.monte_carlo_steps ; i++) {
+		std::random_device dev;
+		const size_t seed = p.mc_seed ? p.mc_seed : (size_t(dev()) << 32) ^ dev();
+		q = this->cached_q(mc_source(), [&](top_k<T> &tail, size_t first, size_t n){
+			#pragma omp parallel
+			{
+				// per thread, reused by its samples.
 				A data(p.size), convolved(p.size);
-				mt19937 gen(seed + i);
-				normal_distribution<T> dist(/*mean*/0, /*stddev*/1);
-				for(auto row : data) for(auto &x : row) x = dist(gen);
-				auto f_data = convolution->prepare_image(data);
-				for(size_t j = 0 ; j < constraints.size() ; j++) {
-					convolution->conv(f_data, constraints[j].k, convolved);
-					auto k_q = norm_inf(convolved) - constraints[j].shift_q;
-					#pragma omp critical
-					k_qs[j].push_back(k_q);
-				}
+				std::shared_ptr<prepared_image> f_data;
+				std::vector<T> maxima, k_q(constraints.size());
+				top_k<T> part(tail.k);
+				#pragma omp for schedule(static)
+				for(size_t i = first ; i < first + n ; i++) {
+					normal_fill(seed, i, data.data(), data.num_elements());
+					convolution->prepare_image_into(data, f_data);
+					convolution->conv_max_abs(*f_data, ks, convolved, maxima);
+					for(size_t j = 0 ; j < constraints.size() ; j++)
+						k_q[j] = maxima[j] - constraints[j].shift_q;
+					this->sample(part, k_q);
 #if HAVE_OPENMP
-				if(omp_get_thread_num() == 0)
-					this->progress(double(i * omp_get_num_threads()) / p.monte_carlo_steps, "Monte Carlo simulation for q");
+					if(omp_get_thread_num() == 0)
+						this->progress(double(first + (i - first) * omp_get_num_threads()) / p.monte_carlo_steps, "Monte Carlo simulation for q");
 #else
-				if(i % 10 == 0) this->progress(double(i) / p.monte_carlo_steps, "Monte Carlo simulation for q");
+					if(i % 10 == 0) this->progress(double(i) / p.monte_carlo_steps, "Monte Carlo simulation for q");
 #endif
+				}
+				#pragma omp critical(chambolle_pock_cpu_tail)
+				tail.merge(part);
 			}
 		});
 		for(auto &c : constraints)
@@ -108,14 +155,30 @@ struct chambolle_pock_cpu : public impl<T> {
 		return true;
 	}
 
-	void debug(const A &a, std::string d) {
+	template<class V, class D>
+	void debug(const V &a, const D &d) {
 		if(this->debug_cb) {
 			#pragma omp critical
-			this->debug_cb(a, d);	
+			this->debug_cb(A(a), d);
+		}
+	}
+
+	// with a debug callback, each adj_k_i * y_i and the sums of w up to
+	// it, convolved one by one as the loop over constraints used to.
+	void debug_adjoint() {
+		if(!this->debug_cb) return;
+		using namespace mimas;
+		A adj_y(p.size), w_i(p.size);
+		fill(w_i, 0);
+		for(size_t i = 0 ; i < constraints.size() ; i++) {
+			convolution->conv(*convolution->prepare_image(A(ys[i])), *adj_ks[i], adj_y);
+			debug(adj_y, str(boost::format("adj_convolved_%d") % i));
+			w_i += adj_y;
+			debug(w_i, str(boost::format("w_%d") % i));
 		}
 	}
 
-	void profile_push(std::string name) {
+	void profile_push(const char *name) {
 		if(this->profiler)
 			this->profiler->tic_cpu(name);
 	}
@@ -125,6 +188,89 @@ struct chambolle_pock_cpu : public impl<T> {
 			this->profiler->toc("");
 	}
 
+	// old_x = x, bar_x = x - Y - tau w: the resolvent input, in one pass.
+	static void primal_in(const A &x, const A &Y, const A &w, T tau, A &old_x, A &bar_x) {
+		const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+			const T *x_r = x[i0].origin(), *Y_r = Y[i0].origin(), *w_r = w[i0].origin();
+			T *old_r = old_x[i0].origin(), *bar_r = bar_x[i0].origin();
+			#pragma omp simd
+			for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+				old_r[i1] = x_r[i1];
+				bar_r[i1] = x_r[i1] - Y_r[i1] - w_r[i1] * tau;
+			}
+		}
+	}
+
+	// x += Y, bar_x = x + theta (x - old_x), out = Y - x, in one pass.
+	// norms[2 i0] and [2 i0 + 1] are the 1-norms of row i0 of x and x - old_x.
+	static void primal_out(const A &Y, const A &old_x, T theta, A &x, A &bar_x, A &out, T *norms) {
+		const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+			const T *Y_r = Y[i0].origin(), *old_r = old_x[i0].origin();
+			T *x_r = x[i0].origin(), *bar_r = bar_x[i0].origin(), *out_r = out[i0].origin();
+			T n_x = 0, n_d = 0;
+			#pragma omp simd reduction(+:n_x,n_d)
+			for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+				const T v = x_r[i1] + Y_r[i1];
+				x_r[i1] = v;
+				bar_r[i1] = (v - old_r[i1]) * theta + v;
+				out_r[i1] = Y_r[i1] - v;
+				n_x += std::abs(v);
+				n_d += std::abs(v - old_r[i1]);
+			}
+			norms[2 * i0] = n_x;
+			norms[2 * i0 + 1] = n_d;
+		}
+	}
+
+	// primal step for any resolvent: x = resolvent(x - Y - tau w) + Y,
+	// bar_x = x + theta (x - old_x), out = Y - x, and the norms as primal_out.
+	template<class Res>
+	void primal(Res *r, T tau, T theta, const A &Y, const A &w,
+		A &x, A &old_x, A &bar_x, A &out, T *norms) {
+		profile_push("(h) resolvent");
+			primal_in(x, Y, w, tau, old_x, bar_x);
+			debug(bar_x, "resolv_in");
+			r->evaluate(tau, bar_x, x);
+		profile_pop();
+		profile_push("(i) bar_x");
+			primal_out(Y, old_x, theta, x, bar_x, out, norms);
+		profile_pop();
+	}
+
+	// L2: the resolvent is a division by 1 + tau, the whole step in one pass.
+	void primal(resolvent_l2_cpu<T> *r, T tau, T theta, const A &Y, const A &w,
+		A &x, A &old_x, A &bar_x, A &out, T *norms) {
+		if(this->debug_cb)
+			return primal<resolvent_l2_cpu<T>>(r, tau, theta, Y, w, x, old_x, bar_x, out, norms);
+		profile_push("(h-i) L2 primal update");
+		const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+		const T d = 1 + tau;
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+			const T *Y_r = Y[i0].origin(), *w_r = w[i0].origin();
+			T *x_r = x[i0].origin(), *old_r = old_x[i0].origin(), *bar_r = bar_x[i0].origin(), *out_r = out[i0].origin();
+			T n_x = 0, n_d = 0;
+			#pragma omp simd reduction(+:n_x,n_d)
+			for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+				const T o = x_r[i1];
+				const T v = (o - Y_r[i1] - w_r[i1] * tau) / d + Y_r[i1];
+				old_r[i1] = o;
+				x_r[i1] = v;
+				bar_r[i1] = (v - o) * theta + v;
+				out_r[i1] = Y_r[i1] - v;
+				n_x += std::abs(v);
+				n_d += std::abs(v - o);
+			}
+			norms[2 * i0] = n_x;
+			norms[2 * i0 + 1] = n_d;
+		}
+		profile_pop();
+	}
+
 	virtual A run(const A &Y_) {
 		using namespace mimas;
 
@@ -138,6 +284,8 @@ struct chambolle_pock_cpu : public impl<T> {
 		profile_push("run");
 		profile_push("allocate");
 			A x(Y), bar_x(Y), old_x(p.size), w(p.size), out(p.size);
+			// 1-norms of each row of x and of its change, for the tolerance.
+			std::vector<T> norms(2 * p.size[0]);
 		profile_pop();
 
 		if(!initialized) {
@@ -147,15 +295,19 @@ struct chambolle_pock_cpu : public impl<T> {
 			initialized = true;
 		}
 
+		profile_push("allocate");
+			// also holds the spectra of ys, if the convolution can.
+			const auto b = convolution->batch_shape(p.size);
+			B convolved(boost::extents[p.stream_dual ? 0 : constraints.size()][b[0]][b[1]]);
+		profile_pop();
+
 		if(p.input_stddev >= 0)
 			input_stddev = p.input_stddev;
 		else
 			input_stddev = median_absolute_deviation(Y_);
 
 		debug(x, "x_in");
-		for(auto &c : constraints) {
-			fill(c.y, 0);
-		}
+		fill(ys, 0);
 
 		T tau = p.tau;
 		T sigma = p.sigma;
@@ -163,84 +315,87 @@ struct chambolle_pock_cpu : public impl<T> {
 		// Adjust sigma with norm.
 		sigma /= tau * total_norm;
 
+		// soft shrinkage of y_j + sigma k_j * bar_x, one row.
+		const typename cpu_convolver<T>::row_update shrink = [&](size_t j, size_t, T *y, const T *k_x) {
+			const T q = constraints[j].q * sigma * input_stddev;
+			// v - clamp(v, -q, q) is v + q, v - q or 0 as the branches were.
+			#pragma omp simd
+			for(size_t i1 = 0 ; i1 < p.size[1] ; i1++) {
+				const T v = y[i1] + k_x[i1] * sigma;
+				y[i1] = v - std::min(std::max(v, -q), q);
+			}
+		};
+
+		// prepared bar_x and ys, reused by each step.
+		std::shared_ptr<prepared_image> f_bar_x;
+		typename cpu_convolver<T>::images f_ys;
+
 		// Repeat until good enough.
 		profile_push("iteration");
 		for(size_t n = 0 ; n < p.max_steps ; n++) {
 			profile_push("step");
-			// reset accumulator
-			profile_push("(a) reset w");
-				fill(w, 0);
-			profile_pop();
-			// transform bar_x for convolutions
-			profile_push("(b) prepare bar_x");
-				const auto f_bar_x = convolution->prepare_image(bar_x);
-			profile_pop();
-			profile_push("constraints");
-			#pragma omp parallel for
-			for(size_t i = 0 ; i < constraints.size() ; i++) {
-				profile_push("kernel");
-				auto &c = constraints[i];
-				// convolve bar_x with kernel
+			if(p.stream_dual) {
+				// (c) to (f) in one pass over the rows.
+				profile_push("(c-f) streamed dual update");
+					convolution->dual_update(bar_x, ks, adj_ks, ys, shrink, w);
+				profile_pop();
+			} else {
+				// transform bar_x for convolutions
+				profile_push("(b) prepare bar_x");
+					convolution->prepare_image_into(bar_x, f_bar_x);
+				profile_pop();
+				// convolve bar_x with all kernels
 				profile_push("(c) k * bar_x");
-					A convolved(p.size);
-					convolution->conv(f_bar_x, c.k, convolved);
+					convolution->conv_all(*f_bar_x, ks, convolved);
 				profile_pop();
-				debug(convolved, str(boost::format("convolved_%d") % i));
-				// calculate new y_i
-				profile_push("(d) soft_shrink");
-					convolved *= sigma;
-					c.y += convolved;
-					const auto q = c.q * sigma * input_stddev;
-					for(auto row : c.y) for(auto &v : row) {
-						if(v < -q) v += q;
-						else if(v > q) v -= q;
-						else v = 0;
-					}
+				profile_push("constraints");
+				#pragma omp parallel for
+				for(size_t i = 0 ; i < constraints.size() ; i++) {
+					profile_push("kernel");
+					auto y = ys[i];
+					const auto k_x = convolved[i];
+					if(this->debug_cb)
+						debug(convolved[boost::indices[i][boost::irange(0, p.size[0])][boost::irange(0, p.size[1])]],
+							str(boost::format("convolved_%d") % i));
+					// calculate new y_i
+					profile_push("(d) soft_shrink");
+						for(size_t i0 = 0 ; i0 < p.size[0] ; i0++)
+							shrink(i, i0, y[i0].origin(), k_x[i0].origin());
+					profile_pop();
+					if(this->debug_cb) debug(y, str(boost::format("y_%d") % i));
+					profile_pop(/*kernel*/);
+				}
 				profile_pop();
-				debug(c.y, str(boost::format("y_%d") % i));
 				// convolve y_i with conjugate transpose of kernel
 				profile_push("(e) prepare y");
-					const auto f_y = convolution->prepare_image(c.y);
-				profile_pop();
-				profile_push("(f) adj_k * y");
-					convolution->conv(f_y, c.adj_k, convolved);
+					convolution->prepare_images_into(ys, convolved, f_ys);
 				profile_pop();
-				debug(convolved, str(boost::format("adj_convolved_%d") % i));
-				// accumulate
-				profile_push("(g) accumulate w");
-					#pragma omp critical
-					w += convolved;
+				// accumulate w = sum_i adj_k_i * y_i
+				profile_push("(f) sum adj_k * y");
+					convolution->conv_sum(f_ys, adj_ks, w);
 				profile_pop();
-				profile_pop(/*kernel*/);
-				debug(w, str(boost::format("w_%d") % i));
 			}
-			profile_pop();
-			if(n % 10 == 0) this->progress(double(n) / p.max_steps, str(boost::format("Chambolle-Pock step %d") % n));
-
-			profile_push("(h) resolvent");
-				old_x = x;
-				w *= tau; bar_x = x; bar_x -= Y; bar_x -= w;
-				debug(bar_x, "resolv_in");
-				resolv->evaluate(tau, bar_x, x);
-				x += Y;
-			profile_pop();
-			debug(x, "resolv_out");
+			debug_adjoint();
+			debug(w, "w");
+			if(n % 10 == 0 && this->progress_cb) this->progress(double(n) / p.max_steps, str(boost::format("Chambolle-Pock step %d") % n));
+
 			const T theta = 1 / sqrt(1 + 2 * tau * resolv->gamma);
+			primal(resolv.get(), tau, theta, Y, w, x, old_x, bar_x, out, norms.data());
+			debug(x, "resolv_out");
+			debug(bar_x, "bar_x");
 			tau *= theta;
 			sigma /= theta;
-			profile_push("(i) bar_x");
-				bar_x = x; bar_x -= old_x; bar_x *= theta; bar_x += x;
-				debug(bar_x, "bar_x");
-
-				out = Y; out -= x;
-			profile_pop();
 			profile_pop(/*step*/);
 
 			if(!current(out, n)) break;
 
-			if(n > 1 && p.tolerance > 0) {
-				const T ch = norm_1(x) / norm_1(x - old_x);
-				if(ch >= p.tolerance) break;
+			if(n > 1 && p.tolerance > 0 && n % std::max<size_t>(p.check_every, 1) == 0) {
+				T n_x = 0, n_d = 0;
+				for(size_t i0 = 0 ; i0 < p.size[0] ; i0++) {
+					n_x += norms[2 * i0];
+					n_d += norms[2 * i0 + 1];
+				}
+				if(n_x / n_d >= p.tolerance) break;
 			}
 		}
 		profile_pop();
@@ -6,7 +6,22 @@
 
 #include "multi_array_fft.h"
 #include "multi_array.h"
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cmath>
+#include <typeindex>
+#include <tuple>
 
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+// Prepared data is owned by the caller, and only borrowed by `conv`.
+// Each convolver only receives what it prepared itself, so it may
+// `static_cast` to its own type and use the data in place.
 struct prepared_image {
 	virtual ~prepared_image() {}
 };
@@ -14,24 +29,272 @@ struct prepared_kernel {
 	virtual ~prepared_kernel() {}
 };
 
+/**
+ * Scratch arrays lent to the convolvers by their owner and kept between
+ * calls, so repeated calls with the same sizes don't allocate. Arrays are
+ * found by type, slot and calling thread, calls that nest use different
+ * slots. Calls from parallel regions, like the Monte Carlo samples, get
+ * arrays of their own thread.
+ */
+struct workspace {
+	// count arrays of shape for slot, made or resized on first use.
+	template<class Array, class S>
+	std::vector<Array> &arrays(size_t slot, size_t count, const S &shape) {
+		std::shared_ptr<void> *p;
+		#pragma omp critical(workspace)
+		{
+			p = &objects[std::make_tuple(std::type_index(typeid(Array)), slot, caller())];
+			if(!*p) *p = std::make_shared<std::vector<Array>>();
+		}
+		auto &v = *static_cast<std::vector<Array> *>(p->get());
+		fit(v, count, shape);
+		return v;
+	}
+
+	template<class Array, class S>
+	static void fit(std::vector<Array> &v, size_t count, const S &shape) {
+		if(v.size() < count) v.resize(count);
+		for(size_t i = 0 ; i < count ; i++)
+			if(!std::equal(shape.begin(), shape.end(), v[i].shape())) v[i].resize(shape);
+	}
+
+	// the calling thread, by its number in each enclosing team.
+	static size_t caller() {
+#if HAVE_OPENMP
+		size_t id = 0;
+		for(int l = 1 ; l <= omp_get_level() ; l++)
+			id = id * 1024 + omp_get_ancestor_thread_num(l) + 1;
+		return id;
+#else
+		return 0;
+#endif
+	}
+
+	// threads of a parallel region started here, and this thread in it.
+	static size_t team() {
+#if HAVE_OPENMP
+		return omp_get_active_level() < omp_get_max_active_levels() ? omp_get_max_threads() : 1;
+#else
+		return 1;
+#endif
+	}
+	static size_t thread() {
+#if HAVE_OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+
+	private:
+	std::map<std::tuple<std::type_index, size_t, size_t>, std::shared_ptr<void>> objects;
+};
+
+// count arrays of shape from the workspace, if any, or owned by this object.
+template<class Array>
+struct scratch {
+	std::vector<Array> own;
+	std::vector<Array> &a;
+
+	template<class S>
+	scratch(const std::shared_ptr<workspace> &w, size_t slot, size_t count, const S &shape)
+	: a(w ? w->arrays<Array>(slot, count, shape) : own) {
+		if(&a == &own) workspace::fit(own, count, shape);
+	}
+
+	Array &operator[](size_t i) { return a[i]; }
+};
+
+// out = parts[0] + ... + parts[m-1], added pairwise in a fixed order, so
+// the result is the same for any number of threads. Rows in parallel,
+// overwrites the parts.
+template<class A>
+void tree_sum(std::vector<A> &parts, size_t m, A &out) {
+	const size_t s0 = out.shape()[0], s1 = out.shape()[1];
+	#pragma omp parallel for
+	for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+		for(size_t step = 1 ; step < m ; step *= 2)
+			for(size_t j = 0 ; j + step < m ; j += 2 * step) {
+				auto a = parts[j][i0].origin();
+				const auto b = parts[j + step][i0].origin();
+				for(size_t i1 = 0 ; i1 < s1 ; i1++)
+					a[i1] += b[i1];
+			}
+		auto o = out[i0].origin();
+		for(size_t i1 = 0 ; i1 < s1 ; i1++)
+			o[i1] = m > 0 ? parts[0][i0][i1] : 0;
+	}
+}
+
 template<class A>
 struct convolver {
 	virtual std::shared_ptr<prepared_image> prepare_image(const A &) = 0;
 	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t, bool) = 0;
-	virtual void conv(std::shared_ptr<prepared_image>, std::shared_ptr<prepared_kernel>, A &) = 0;
+	virtual void conv(const prepared_image &, const prepared_kernel &, A &) = 0;
 	virtual ~convolver() {}
 };
 
 template<class T>
 struct cpu_convolver : convolver<boost::multi_array<T, 2>> {
 	typedef boost::multi_array<T, 2> A;
+	// batch of images, first dimension is the batch.
+	typedef boost::multi_array<T, 3> B;
+	typedef std::vector<std::shared_ptr<prepared_image>> images;
+
+	// scratch arrays, if any. Slots 1 and 2 are used by the defaults below,
+	// which call the others, slot 3 by hybrid_convolver around its convolvers.
+	std::shared_ptr<workspace> work;
+
+	virtual void use_workspace(std::shared_ptr<workspace> w) {
+		work = w;
+	}
+
+	// like prepare_image, may reuse out if nothing else holds it.
+	virtual void prepare_image_into(const A &in, std::shared_ptr<prepared_image> &out) {
+		out = this->prepare_image(in);
+	}
+
+	// prepare each in[j], default: one after another.
+	virtual std::vector<std::shared_ptr<prepared_image>> prepare_images(const B &in) {
+		std::vector<std::shared_ptr<prepared_image>> out(in.shape()[0]);
+		#pragma omp parallel for
+		for(size_t j = 0 ; j < out.size() ; j++)
+			out[j] = this->prepare_image(A(in[j]));
+		return out;
+	}
+
+	// out[j] = k_j * i, default: convolve with each kernel.
+	virtual void conv_all(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, B &out) {
+		scratch<A> temps(work, 1, workspace::team(), size2_t{{out.shape()[1], out.shape()[2]}});
+		#pragma omp parallel
+		{
+			A &temp = temps[workspace::thread()];
+			#pragma omp for
+			for(size_t j = 0 ; j < ks.size() ; j++) {
+				this->conv(i, *ks[j], temp);
+				out[j] = temp;
+			}
+		}
+	}
+
+	// out = sum_j k_j * i_j, default: convolve each pair into its own
+	// buffer, then add them with tree_sum, independent of the threads.
+	virtual void conv_sum(const std::vector<std::shared_ptr<prepared_image>> &is,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, A &out) {
+		scratch<A> parts(work, 2, is.size(), boost::extents_of(out));
+		#pragma omp parallel for
+		for(size_t j = 0 ; j < is.size() ; j++)
+			this->conv(*is[j], *ks[j], parts[j]);
+		tree_sum(parts.a, is.size(), out);
+	}
+
+	// out[j] = max |k_j * i|, default: convolve into temp of the image size.
+	virtual void conv_max_abs(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, A &temp, std::vector<T> &out) {
+		out.resize(ks.size());
+		for(size_t j = 0 ; j < ks.size() ; j++) {
+			this->conv(i, *ks[j], temp);
+			out[j] = mimas::norm_inf(temp);
+		}
+	}
+
+	// sizes of the kernels about to be prepared, default: ignored.
+	virtual void plan(const std::vector<size_t> &) {}
+
+	// shape of each image in a batch for conv_all and prepare_images_into,
+	// for images of size s: rows may be longer and more of them, the image
+	// is at the start. default: s.
+	virtual size2_t batch_shape(size2_t s) { return s; }
+
+	// like prepare_images into out, reusing what nothing else holds. The
+	// results may keep their data in storage of batch_shape, which must
+	// outlive them. default: storage unused.
+	virtual void prepare_images_into(const B &in, B &, images &out) {
+		out = prepare_images(in);
+	}
+
+	// new row i0 of y_j from the old one and row i0 of k_j * x.
+	typedef std::function<void(size_t j, size_t i0, T *y, const T *k_x)> row_update;
+
+	// dual step: ys[j] = update(ys[j], k_j * x), then w = sum_j adj_k_j * ys[j].
+	// default: full image passes.
+	virtual void dual_update(const A &x,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks,
+		const std::vector<std::shared_ptr<prepared_kernel>> &adj_ks,
+		B &ys, const row_update &update, A &w) {
+		const size_t s0 = ys.shape()[1];
+		// k_j * x in batch_shape, then the storage of the prepared ys.
+		const size2_t b = batch_shape(size2_t{{s0, ys.shape()[2]}});
+		scratch<B> k_xs(work, 1, 1, std::array<size_t, 3>{{ks.size(), b[0], b[1]}});
+		B &k_x = k_xs[0];
+		prepare_image_into(x, dual_x);
+		conv_all(*dual_x, ks, k_x);
+		#pragma omp parallel for collapse(2)
+		for(size_t j = 0 ; j < ks.size() ; j++)
+			for(size_t i0 = 0 ; i0 < s0 ; i0++)
+				update(j, i0, ys[j][i0].origin(), k_x[j][i0].origin());
+		prepare_images_into(ys, k_x, dual_ys);
+		conv_sum(dual_ys, adj_ks, w);
+	}
 
 	virtual std::shared_ptr<prepared_image> _prepare_image(const A &k) {
 		return this->prepare_image(k);
 	};
-	virtual void _conv(std::shared_ptr<prepared_image> i, std::shared_ptr<prepared_kernel> k, A &o) {
+	virtual void _conv(const prepared_image &i, const prepared_kernel &k, A &o) {
 		this->conv(i,k,o);
 	};
+
+	private:
+	// x and ys prepared by the default dual_update, reused by the next.
+	std::shared_ptr<prepared_image> dual_x;
+	images dual_ys;
+};
+
+/**
+ * Base of the CPU convolvers that work on the image itself: a prepared
+ * image is a copy of it, reused when nothing else holds it.
+ */
+template<class T>
+struct cpu_copying_convolver : cpu_convolver<T> {
+	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T, 3> B;
+
+	struct prep_i : prepared_image {
+		A f;
+		template<class I>
+		prep_i(const I &in) : f(in) {}
+	};
+
+	virtual std::shared_ptr<prepared_image> prepare_image(const A &in) {
+		return std::make_shared<prep_i>(in);
+	}
+
+	virtual void prepare_image_into(const A &in, std::shared_ptr<prepared_image> &out) {
+		copy_into(in, out);
+	}
+
+	virtual std::vector<std::shared_ptr<prepared_image>> prepare_images(const B &in) {
+		std::vector<std::shared_ptr<prepared_image>> out(in.shape()[0]);
+		#pragma omp parallel for
+		for(size_t j = 0 ; j < out.size() ; j++)
+			out[j] = std::make_shared<prep_i>(in[j]);
+		return out;
+	}
+
+	virtual void prepare_images_into(const B &in, B &, typename cpu_convolver<T>::images &out) {
+		out.resize(in.shape()[0]);
+		#pragma omp parallel for
+		for(size_t j = 0 ; j < out.size() ; j++)
+			copy_into(in[j], out[j]);
+	}
+
+	private:
+	template<class I>
+	static void copy_into(const I &in, std::shared_ptr<prepared_image> &out) {
+		if(out && out.use_count() == 1) static_cast<prep_i &>(*out).f = in;
+		else out = std::make_shared<prep_i>(in);
+	}
 };
 
 template<class T>
@@ -46,7 +309,7 @@ struct gpu_convolver : convolver<vex::vector<T>> {
 		return this->prepare_image(d_in);
 	}
 
-	virtual void _conv(std::shared_ptr<prepared_image> i, std::shared_ptr<prepared_kernel> k, cpu_A &h_out) {
+	virtual void _conv(const prepared_image &i, const prepared_kernel &k, cpu_A &h_out) {
 		gpu_A d_out(h_out.num_elements());
 		this->conv(i, k, d_out);
 		vex::copy(d_out, h_out.data());
@@ -102,9 +365,9 @@ struct gpu_fft_convolver : gpu_convolver<T> {
 		return p;
 	}
 
-	virtual void conv(std::shared_ptr<prepared_image> i, std::shared_ptr<prepared_kernel> k, A &out) {
-		auto fi = std::dynamic_pointer_cast<prep>(i)->f;
-		auto fk = std::dynamic_pointer_cast<prep>(k)->f;
+	virtual void conv(const prepared_image &i, const prepared_kernel &k, A &out) {
+		const auto &fi = static_cast<const prep &>(i).f;
+		const auto &fk = static_cast<const prep &>(k).f;
 		temp = complex_mul(fi, fk);
 		out = ifft(temp);
 	}
@@ -117,47 +380,502 @@ struct cpu_fft_convolver : cpu_convolver<T> {
 	typedef std::complex<T> T2;
 	typedef boost::multi_array<T, 2> A;
 	typedef boost::multi_array<T2, 2> A2;
+	typedef boost::multi_array<T, 3> B;
+	typedef boost::multi_array<T2, 3> B2;
+	typedef boost::multi_array_ref<T2, 2> R2;
+	// kernel spectra are computed in at least double precision.
+	typedef typename std::common_type<T, double>::type W;
 
-	struct prep : prepared_image, prepared_kernel {
-		A2 f;
-		prep(size2_t s) : f(s) {}
+	// spectrum, may be part of a batch.
+	struct prep_i : prepared_image {
+		std::shared_ptr<B2> batch;
+		R2 f;
+		prep_i(std::shared_ptr<B2> batch, size_t j)
+		: batch(batch), f((*batch)[j].origin(), boost::extents_of((*batch)[j])) {}
+		prep_i(size2_t s)
+		: prep_i(std::make_shared<B2>(boost::extents[1][s[0]][s[1]]), 0) {}
+		// borrowed spectrum.
+		prep_i(T2 *f, size2_t s) : f(f, s) {}
 	};
 
-	fftw::plan<T, T2, 2> fft;
-	fftw::plan<T2, T, 2> ifft;
-	const size2_t s, f_s;
+	// spectrum of a box is separable: f[i0][i1] = f0[i0] * f1[i1].
+	struct prep_k : prepared_kernel {
+		std::vector<T2> f0, f1;
+		prep_k(std::vector<T2> f0, std::vector<T2> f1) : f0(f0), f1(f1) {}
+	};
 
-	cpu_fft_convolver(size2_t s)
-	: fft(s), ifft(s), s(s), f_s{{s[0], s[1]/2+1}} {}
+	// threads for each transform, one inside parallel regions, where the
+	// other threads run transforms of their own.
+	const int threads;
+	// image size, transform size and size of the spectrum.
+	const size2_t s, n, f_s;
+	// periodic extension on each side of padded dimensions.
+	const size_t halo;
+	// transform in place, real rows padded to the spectrum: 2 f_s[1] values.
+	const bool in_place;
+	// plans by threads, batched ones by batch size and threads.
+	std::map<int, fftw::plan<T, T2, 2>> fft;
+	std::map<int, fftw::plan<T2, T, 2>> ifft;
+	std::map<std::pair<size_t, int>, fftw::plan_many<T, T2, 2>> fft_many;
+	std::map<std::pair<size_t, int>, fftw::plan_many<T2, T, 2>> ifft_many;
+	std::map<std::pair<size_t, int>, fftw::plan_in_place<T, 2, fftw::forward>> fft_in_place;
+	std::map<std::pair<size_t, int>, fftw::plan_in_place<T, 2, fftw::inverse>> ifft_in_place;
+
+	// with pad_box > 0, dimensions with large prime factors are padded to
+	// sizes FFTW is fast on, for boxes up to pad_box.
+	// with in_place, image, spectrum and result share one buffer.
+	cpu_fft_convolver(size2_t s, int threads = 1, size_t pad_box = 0, bool in_place = false)
+	: threads(threads), s(s), n(padded(s, pad_box)), f_s{{n[0], n[1]/2+1}},
+	  halo(pad_box > 0 ? pad_box - 1 : 0), in_place(in_place) {
+		if(in_place) return;
+		one(fft);
+		one(ifft);
+	}
+
+	// transform size for an image of size s.
+	static size2_t padded(size2_t s, size_t pad_box) {
+		if(pad_box == 0) return s;
+		for(auto &d : s)
+			if(fftw::good_size(d) != d) d = fftw::good_size(d + 2 * (pad_box - 1));
+		return s;
+	}
 
 	virtual std::shared_ptr<prepared_image> prepare_image(const A &in) {
-		auto i = std::make_shared<prep>(f_s);
-		fft(in, i->f);
+		auto i = std::make_shared<prep_i>(f_s);
+		forward(in, i->f);
 		return i;
 	}
 
+	// reuses a single spectrum that only out holds.
+	virtual void prepare_image_into(const A &in, std::shared_ptr<prepared_image> &out) {
+		if(out && out.use_count() == 1) {
+			auto &i = static_cast<prep_i &>(*out);
+			if(i.batch && i.batch.use_count() == 1 && i.batch->shape()[0] == 1)
+				return forward(in, i.f);
+		}
+		out = prepare_image(in);
+	}
+
+	virtual std::vector<std::shared_ptr<prepared_image>> prepare_images(const B &in) {
+		typename cpu_convolver<T>::images out;
+		prepare_batch(in, out);
+		return out;
+	}
+
+	virtual size2_t batch_shape(size2_t s) {
+		if(in_place) return size2_t{{n[0], 2 * f_s[1]}};
+		return s;
+	}
+
+	// in place, the spectra replace the padded images in storage.
+	virtual void prepare_images_into(const B &in, B &storage, typename cpu_convolver<T>::images &out) {
+		if(!stored(storage)) return prepare_batch(in, out);
+		const size_t m = in.shape()[0];
+		for(size_t j = 0 ; j < m ; j++)
+			pad(in[j].origin(), storage[j].origin(), 2 * f_s[1]);
+		T2 *f = reinterpret_cast<T2 *>(storage.data());
+		many(fft_in_place, m)(f);
+		out.resize(m);
+		for(size_t j = 0 ; j < m ; j++) {
+			T2 *f_j = f + j * f_s[0] * f_s[1];
+			if(!out[j] || out[j].use_count() != 1 || static_cast<prep_i &>(*out[j]).f.data() != f_j)
+				out[j] = std::make_shared<prep_i>(f_j, f_s);
+		}
+	}
+
 	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t h, bool adj) {
-		const T v = 1 / (s[0] * s[1] * M_SQRT2 * h);
-		boost::multi_array<T, 2> k(s);
-		mimas::fill(k, 0);
-		for(size_t i0 = 0 ; i0 < h ; i0++)
-			for(size_t i1 = 0 ; i1 < h ; i1++) {
-				if(adj) k[i0][i1] = v;
-				else k[(s[0] - i0) % s[0]][(s[1] - i1) % s[1]] = v;			
-			}
-		auto p = std::make_shared<prep>(f_s);
-		fft(k, p->f);
-		return p;
+		if(n != s && h > halo + 1) throw std::invalid_argument("box too large for the padding");
+		const W v = 1 / (W(n[0]) * n[1] * std::sqrt(W(2)) * h);
+		return std::make_shared<prep_k>(box_dft(n[0], f_s[0], h, adj, v), box_dft(n[1], f_s[1], h, adj, 1));
 	}
 
-	virtual void conv(std::shared_ptr<prepared_image> i, std::shared_ptr<prepared_kernel> k, A &out) {
-		auto fi = std::dynamic_pointer_cast<prep>(i)->f;
-		auto fk = std::dynamic_pointer_cast<prep>(k)->f;
-		A2 temp(f_s);
+	virtual void conv(const prepared_image &i, const prepared_kernel &k_, A &out) {
+		const auto &fi = static_cast<const prep_i &>(i).f;
+		const auto &k = static_cast<const prep_k &>(k_);
+		scratch<A2> temp(this->work, 0, 1, f_s);
 		for(size_t i0 = 0 ; i0 < f_s[0] ; i0++)
 			for(size_t i1 = 0 ; i1 < f_s[1] ; i1++)
-				temp[i0][i1] = fi[i0][i1] * fk[i0][i1];
-		ifft(temp, out);
+				temp[0][i0][i1] = fi[i0][i1] * (k.f0[i0] * k.f1[i1]);
+		inverse(temp[0], out);
+	}
+
+	// multiply each row of the image with all kernels, then one batched inverse transform.
+	// in place with out of batch_shape, the spectra are transformed in out.
+	virtual void conv_all(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, B &out) {
+		const auto &fi = static_cast<const prep_i &>(i).f;
+		const size_t m = ks.size();
+		pks.clear();
+		for(auto k : ks) pks.push_back(&static_cast<const prep_k &>(*k));
+		const bool direct = stored(out);
+		scratch<B2> temp(this->work, 0, direct ? 0 : 1, std::array<size_t, 3>{{m, f_s[0], f_s[1]}});
+		T2 *f = direct ? reinterpret_cast<T2 *>(out.data()) : temp[0].data();
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < f_s[0] ; i0++)
+			for(size_t j = 0 ; j < m ; j++) {
+				const T2 k0 = pks[j]->f0[i0];
+				const auto &f1 = pks[j]->f1;
+				T2 *row = f + (j * f_s[0] + i0) * f_s[1];
+				for(size_t i1 = 0 ; i1 < f_s[1] ; i1++)
+					row[i1] = fi[i0][i1] * (k0 * f1[i1]);
+			}
+		if(in_place) {
+			many(ifft_in_place, m)(f);
+			if(!direct)
+				for(size_t j = 0 ; j < m ; j++)
+					crop(real(temp[0][j].origin()), out[j].origin(), 2 * f_s[1]);
+		} else if(n == s) many(ifft_many, m)(temp[0], out);
+		else {
+			scratch<B> full(this->work, 0, 1, std::array<size_t, 3>{{m, n[0], n[1]}});
+			many(ifft_many, m)(temp[0], full[0]);
+			for(size_t j = 0 ; j < m ; j++)
+				crop(full[0][j].origin(), out[j].origin());
+		}
+	}
+
+	// accumulate in the frequency domain, needs only one inverse transform.
+	virtual void conv_sum(const std::vector<std::shared_ptr<prepared_image>> &is,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, A &out) {
+		fis.clear();
+		pks.clear();
+		for(size_t j = 0 ; j < is.size() ; j++) {
+			fis.push_back(&static_cast<const prep_i &>(*is[j]).f);
+			pks.push_back(&static_cast<const prep_k &>(*ks[j]));
+		}
+		scratch<A2> temp(this->work, 0, 1, f_s);
+		A2 &f = temp[0];
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < f_s[0] ; i0++)
+			for(size_t i1 = 0 ; i1 < f_s[1] ; i1++) {
+				T2 sum = 0;
+				for(size_t j = 0 ; j < fis.size() ; j++)
+					sum += (*fis[j])[i0][i1] * (pks[j]->f0[i0] * pks[j]->f1[i1]);
+				f[i0][i1] = sum;
+			}
+		inverse(f, out);
+	}
+
+	// first m coefficients of the DFT of a length n box of h ones at 0..h-1 (adj)
+	// or 0,-1..-(h-1), i.e. a scaled Dirichlet kernel.
+	static std::vector<T2> box_dft(size_t n, size_t m, size_t h, bool adj, W scale) {
+		std::vector<T2> out(m);
+		const W pi = std::acos(W(-1));
+		for(size_t k = 0 ; k < m ; k++) {
+			const W a = pi * k / n;
+			const W r = k == 0 ? h : std::sin(a * h) / std::sin(a);
+			const W phase = (adj ? -a : a) * (h - 1);
+			out[k] = T2(scale * r * std::cos(phase), scale * r * std::sin(phase));
+		}
+		return out;
+	}
+
+	private:
+	// operands of the last conv_all/conv_sum, kept to reuse their capacity.
+	std::vector<const prep_k *> pks;
+	std::vector<const R2 *> fis;
+
+	// source of index i of a padded dimension: the image extended
+	// periodically forward by the halo for boxes, backward for their adjoints.
+	size_t wrap(size_t i, size_t d) const {
+		if(i < s[d] + halo) return i % s[d];
+		return (s[d] - (n[d] - i) % s[d]) % s[d];
+	}
+
+	// into rows of the given length.
+	void pad(const T *in, T *out, size_t stride) const {
+		for(size_t i0 = 0 ; i0 < n[0] ; i0++) {
+			const T *row = in + wrap(i0, 0) * s[1];
+			T *o = out + i0 * stride;
+			std::copy(row, row + s[1], o);
+			for(size_t i1 = s[1] ; i1 < n[1] ; i1++)
+				o[i1] = row[wrap(i1, 1)];
+		}
+	}
+
+	// the image part of a result with rows of the given length.
+	void crop(const T *in, T *out, size_t stride) const {
+		for(size_t i0 = 0 ; i0 < s[0] ; i0++)
+			std::copy(in + i0 * stride, in + i0 * stride + s[1], out + i0 * s[1]);
+	}
+	void crop(const T *in, T *out) const { crop(in, out, n[1]); }
+
+	static T *real(T2 *f) { return reinterpret_cast<T *>(f); }
+
+	// whether a batch has the in place layout.
+	bool stored(const B &b) const {
+		return in_place && b.shape()[1] == n[0] && b.shape()[2] == 2 * f_s[1];
+	}
+
+	// inverse transform of f, destroys f.
+	void inverse(A2 &f, A &out) {
+		if(in_place) {
+			many(ifft_in_place, 1)(f.data());
+			return crop(real(f.data()), out.data(), 2 * f_s[1]);
+		}
+		if(n == s) return one(ifft)(f, out);
+		scratch<A> full(this->work, 0, 1, n);
+		one(ifft)(f, full[0]);
+		crop(full[0].data(), out.data());
+	}
+
+	// spectrum of in.
+	void forward(const A &in, R2 &f) {
+		if(in_place) {
+			pad(in.data(), real(f.data()), 2 * f_s[1]);
+			many(fft_in_place, 1)(f.data());
+		} else if(n == s) one(fft)(in, f);
+		else {
+			scratch<A> temp(this->work, 0, 1, n);
+			pad(in.data(), temp[0].data(), n[1]);
+			one(fft)(temp[0], f);
+		}
+	}
+
+	// spectra of in as one batch, the one of out if nothing else holds it.
+	void prepare_batch(const B &in, typename cpu_convolver<T>::images &out) {
+		const size_t m = in.shape()[0];
+		auto batch = reusable_batch(out, m);
+		const bool fresh = !batch;
+		if(fresh) batch = std::make_shared<B2>(boost::extents[m][f_s[0]][f_s[1]]);
+		if(in_place) {
+			for(size_t j = 0 ; j < m ; j++)
+				pad(in[j].origin(), real((*batch)[j].origin()), 2 * f_s[1]);
+			many(fft_in_place, m)(batch->data());
+		} else if(n == s) many(fft_many, m)(in, *batch);
+		else {
+			scratch<B> temp(this->work, 0, 1, std::array<size_t, 3>{{m, n[0], n[1]}});
+			for(size_t j = 0 ; j < m ; j++)
+				pad(in[j].origin(), temp[0][j].origin(), n[1]);
+			many(fft_many, m)(temp[0], *batch);
+		}
+		if(!fresh) return;
+		out.clear();
+		for(size_t j = 0 ; j < m ; j++)
+			out.push_back(std::make_shared<prep_i>(batch, j));
+	}
+
+	// the batch of out[0..m-1] if out holds all of it and nothing else does.
+	static std::shared_ptr<B2> reusable_batch(const typename cpu_convolver<T>::images &out, size_t m) {
+		if(m == 0 || out.size() != m || !out[0]) return nullptr;
+		const auto batch = static_cast<const prep_i &>(*out[0]).batch;
+		if(!batch || batch->shape()[0] != m || batch.use_count() != long(m) + 1) return nullptr;
+		for(size_t j = 0 ; j < m ; j++)
+			if(!out[j] || out[j].use_count() != 1
+			|| static_cast<const prep_i &>(*out[j]).f.data() != (*batch)[j].origin())
+				return nullptr;
+		return batch;
+	}
+
+	int transform_threads() const {
+#if HAVE_OPENMP
+		if(omp_in_parallel()) return 1;
+#endif
+		return threads;
+	}
+
+	// the plan for the threads of this call, batched ones for m images.
+	template<class P>
+	P &one(std::map<int, P> &plans) {
+		const int t = transform_threads();
+		P *p;
+		#pragma omp critical(cpu_fft_convolver_many)
+		{
+			auto i = plans.find(t);
+			if(i == plans.end()) i = plans.emplace(t, P(n, 0, t)).first;
+			p = &i->second;
+		}
+		return *p;
+	}
+
+	template<class P>
+	P &many(std::map<std::pair<size_t, int>, P> &plans, size_t m) {
+		const auto key = std::make_pair(m, transform_threads());
+		P *p;
+		#pragma omp critical(cpu_fft_convolver_many)
+		{
+			auto i = plans.find(key);
+			if(i == plans.end()) i = plans.emplace(key, P(n, m, 0, key.second)).first;
+			p = &i->second;
+		}
+		return *p;
+	}
+};
+
+
+
+/**
+ * Overlap-save FFT convolution on tiles of at most n x n, with one small
+ * plan and kernel spectra of tile size, for images too large for full size
+ * spectra. Each tile has a halo of h-1 on both sides for the largest box h
+ * prepared so far. Dimensions that fit into a tile are transformed whole,
+ * so the results stay circular as with cpu_fft_convolver.
+ */
+template<class T>
+struct cpu_tiled_fft_convolver : cpu_copying_convolver<T> {
+	typedef std::complex<T> T2;
+	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T2, 2> A2;
+	typedef boost::multi_array<T, 3> B;
+	typedef typename cpu_copying_convolver<T>::prep_i prep_i;
+
+	// separable spectrum on a tile.
+	struct prep_k : prepared_kernel {
+		std::vector<T2> f0, f1;
+		prep_k(std::vector<T2> f0, std::vector<T2> f1) : f0(f0), f1(f1) {}
+	};
+
+	// image, tile and tile spectrum size.
+	const size2_t s, n, f_n;
+	fftw::plan<T, T2, 2> fft;
+	fftw::plan<T2, T, 2> ifft;
+	size_t h_max = 1;
+
+	cpu_tiled_fft_convolver(size2_t s, size_t tile = 512)
+	: s(s), n{{std::min(s[0], tile), std::min(s[1], tile)}}, f_n{{n[0], n[1]/2+1}},
+	  fft(n), ifft(n) {}
+
+	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t h, bool adj) {
+		for(size_t d = 0 ; d < 2 ; d++)
+			if(s[d] > n[d] && 2 * (h - 1) >= n[d])
+				throw std::invalid_argument("box too large for the tile size");
+		h_max = std::max(h_max, h);
+		typedef typename cpu_fft_convolver<T>::W W;
+		const W v = 1 / (W(n[0]) * n[1] * std::sqrt(W(2)) * h);
+		return std::make_shared<prep_k>(
+			cpu_fft_convolver<T>::box_dft(n[0], f_n[0], h, adj, v),
+			cpu_fft_convolver<T>::box_dft(n[1], f_n[1], h, adj, 1));
+	}
+
+	virtual void conv(const prepared_image &i, const prepared_kernel &k, A &out) {
+		const auto &in = static_cast<const prep_i &>(i).f;
+		const auto &pk = static_cast<const prep_k &>(k);
+		tiles([&](const tile_t &t, A &x, A2 &f, A2 &temp) {
+			load(t, in, x);
+			fft(x, f);
+			multiply(f, pk, temp, false);
+			ifft(temp, x);
+			store(t, x, out.origin());
+		});
+	}
+
+	// one forward transform of each tile for all kernels. With fewer tiles
+	// than threads, each pair of a tile and a kernel goes to a thread of
+	// its own instead, if that leaves the busiest thread fewer transforms:
+	// two for each pair against one and one for each kernel for each tile.
+	virtual void conv_all(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, B &out) {
+		const auto &in = static_cast<const prep_i &>(i).f;
+		const size_t m = ks.size(), c = layout().count, team = workspace::team();
+		const size_t parts = m > 1 && 2 * ((c * m + team - 1) / team) < (m + 1) * ((c + team - 1) / team) ? m : 1;
+		const size_t per_part = m / parts;
+		tiles(parts, [&](const tile_t &t, size_t part, A &x, A2 &f, A2 &temp) {
+			load(t, in, x);
+			fft(x, f);
+			for(size_t j = part * per_part ; j < (part + 1) * per_part ; j++) {
+				multiply(f, static_cast<const prep_k &>(*ks[j]), temp, false);
+				ifft(temp, x);
+				store(t, x, out[j].origin());
+			}
+		});
+	}
+
+	// accumulate each tile in the frequency domain, one inverse transform.
+	virtual void conv_sum(const std::vector<std::shared_ptr<prepared_image>> &is,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, A &out) {
+		tiles([&](const tile_t &t, A &x, A2 &f, A2 &temp) {
+			for(size_t j = 0 ; j < is.size() ; j++) {
+				load(t, static_cast<const prep_i &>(*is[j]).f, x);
+				fft(x, f);
+				multiply(f, static_cast<const prep_k &>(*ks[j]), temp, j > 0);
+			}
+			ifft(temp, x);
+			store(t, x, out.origin());
+		});
+	}
+
+	private:
+	// tile input starts at a - halo, output a..a+l-1 comes from halo..halo+l-1.
+	struct tile_t {
+		size2_t a, l, halo;
+	};
+
+	// tiles of the image: halo and output length along each dimension,
+	// how many along each and in all.
+	struct layout_t {
+		size2_t halo, l, counts;
+		size_t count;
+	};
+
+	layout_t layout() const {
+		layout_t g;
+		for(size_t d = 0 ; d < 2 ; d++) {
+			g.halo[d] = s[d] > n[d] ? h_max - 1 : 0;
+			g.l[d] = n[d] - 2 * g.halo[d];
+			g.counts[d] = (s[d] + g.l[d] - 1) / g.l[d];
+		}
+		g.count = g.counts[0] * g.counts[1];
+		return g;
+	}
+
+	// f for each tile, with per thread buffers from the workspace.
+	template<class F>
+	void tiles(F f) {
+		tiles(1, [&](const tile_t &t, size_t, A &x, A2 &spec, A2 &temp) { f(t, x, spec, temp); });
+	}
+
+	// f for each tile and part 0 .. parts-1 of its work.
+	template<class F>
+	void tiles(size_t parts, F f) {
+		const auto g = layout();
+		scratch<A> xs(this->work, 0, workspace::team(), n);
+		scratch<A2> specs(this->work, 0, 2 * workspace::team(), f_n);
+		#pragma omp parallel
+		{
+			const size_t th = workspace::thread();
+			A &x = xs[th];
+			A2 &spec = specs[2 * th], &temp = specs[2 * th + 1];
+			#pragma omp for collapse(3) schedule(dynamic)
+			for(size_t t0 = 0 ; t0 < g.counts[0] ; t0++)
+				for(size_t t1 = 0 ; t1 < g.counts[1] ; t1++)
+					for(size_t part = 0 ; part < parts ; part++) {
+						tile_t t;
+						t.a = {{t0 * g.l[0], t1 * g.l[1]}};
+						t.l = {{std::min(g.l[0], s[0] - t.a[0]), std::min(g.l[1], s[1] - t.a[1])}};
+						t.halo = g.halo;
+						f(t, part, x, spec, temp);
+					}
+		}
+	}
+
+	// circular gather of the tile input.
+	void load(const tile_t &t, const A &in, A &x) const {
+		const size_t s0 = s[0], s1 = s[1];
+		const size_t b0 = (t.a[0] + s0 - t.halo[0]) % s0, b1 = (t.a[1] + s1 - t.halo[1]) % s1;
+		const size_t first = std::min(n[1], s1 - b1);
+		for(size_t p0 = 0 ; p0 < n[0] ; p0++) {
+			const T *row = in.data() + ((b0 + p0) % s0) * s1;
+			T *dst = x.data() + p0 * n[1];
+			std::copy(row + b1, row + b1 + first, dst);
+			std::copy(row, row + n[1] - first, dst + first);
+		}
+	}
+
+	void store(const tile_t &t, const A &x, T *out) const {
+		for(size_t r0 = 0 ; r0 < t.l[0] ; r0++) {
+			const T *src = x.data() + (t.halo[0] + r0) * n[1] + t.halo[1];
+			std::copy(src, src + t.l[1], out + (t.a[0] + r0) * s[1] + t.a[1]);
+		}
+	}
+
+	// out (+)= f * k.
+	void multiply(const A2 &f, const prep_k &k, A2 &out, bool add) const {
+		for(size_t i0 = 0 ; i0 < f_n[0] ; i0++) {
+			const T2 k0 = k.f0[i0];
+			for(size_t i1 = 0 ; i1 < f_n[1] ; i1++) {
+				const T2 v = f[i0][i1] * (k0 * k.f1[i1]);
+				out[i0][i1] = add ? out[i0][i1] + v : v;
+			}
+		}
 	}
 };
 
@@ -203,20 +921,20 @@ struct gpu_sat_convolver : gpu_convolver<T> {
 		return std::make_shared<prep_k>(h, adj);
 	}
 
-	virtual void conv(std::shared_ptr<prepared_image> i, std::shared_ptr<prepared_kernel> k_, A &out) {
-		const auto sat = std::dynamic_pointer_cast<prep_i>(i)->f;
-		const auto k = std::dynamic_pointer_cast<prep_k>(k_);
-		const T v = 1 / (M_SQRT2 * k->h);
+	virtual void conv(const prepared_image &i, const prepared_kernel &k_, A &out) {
+		const auto &sat = static_cast<const prep_i &>(i).f;
+		const auto &k = static_cast<const prep_k &>(k_);
+		const T v = 1 / (M_SQRT2 * k.h);
 		box_sum.setArg(0, sat(0));
 		box_sum.setArg(1, out(0));
 		box_sum.setArg(2, v);
 		box_sum.setArg(3, cl_uint2{{(cl_uint)s[0], (cl_uint)s[1]}});
-		if(k->adj) {
-			box_sum.setArg(4, cl_int2{{-(cl_int)k->h, -(cl_int)k->h}});
+		if(k.adj) {
+			box_sum.setArg(4, cl_int2{{-(cl_int)k.h, -(cl_int)k.h}});
 			box_sum.setArg(5, cl_int2{{0, 0}});
 		} else {
 			box_sum.setArg(4, cl_int2{{-1, -1}});
-			box_sum.setArg(5, cl_int2{{(cl_int)k->h - 1, (cl_int)k->h - 1}});
+			box_sum.setArg(5, cl_int2{{(cl_int)k.h - 1, (cl_int)k.h - 1}});
 		}
 
 		auto dev = vex::qdev(queues[0]);
@@ -257,13 +975,64 @@ struct gpu_sat_convolver : gpu_convolver<T> {
 
 
 
+// Summed area table entries: floating point types accumulate with
+// compensated sums, int64_t is fixed point with exact, wrapping sums.
+template<class S>
+struct sat_accumulator {
+	typedef S type;
+	typedef S value_type;
+	static const bool exact = false;
+	template<class T> static double scale(const T *, size_t) { return 1; }
+	template<class T> static type encode(const T &x, double) { return x; }
+	static value_type decode(const type &x, double) { return x; }
+};
+
+template<>
+struct sat_accumulator<int64_t> {
+	typedef uint64_t type;
+	typedef double value_type;
+	static const bool exact = true;
+	// largest power of two that keeps the total sum below 2^62.
+	template<class T> static double scale(const T *in, size_t n) {
+		double m = 0;
+		for(size_t i = 0 ; i < n ; i++) m = std::max(m, std::abs(double(in[i])));
+		if(m == 0) return 1;
+		int e;
+		std::frexp(m * n, &e);
+		return std::ldexp(1.0, 62 - e);
+	}
+	template<class T> static type encode(const T &x, double scale) {
+		return type(std::llround(double(x) * scale));
+	}
+	static value_type decode(const type &x, double scale) {
+		return double(int64_t(x)) / scale;
+	}
+};
+
+// at least double precision.
 template<class T>
+struct accumulator_of {
+	typedef typename std::conditional<(sizeof(T) > sizeof(double)), T, double>::type type;
+};
+
+
+/**
+ * Box sums from a summed area table with entries of type S.
+ * The table is built with parallel row prefix sums and a column pass
+ * in cache-sized blocks of columns.
+ */
+template<class T, class S = T>
 struct cpu_sat_convolver : cpu_convolver<T> {
 	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T, 3> B;
+	typedef sat_accumulator<S> acc;
+	typedef typename acc::type ST;
+	typedef boost::multi_array<ST, 2> AS;
 
 	struct prep_i : prepared_image {
-		A f;
-		prep_i(size2_t s) : f(s) {}
+		AS f;
+		double scale;
+		prep_i(size2_t s) : f(s), scale(1) {}
 	};
 
 	struct prep_k : prepared_kernel {
@@ -279,42 +1048,304 @@ struct cpu_sat_convolver : cpu_convolver<T> {
 
 	virtual std::shared_ptr<prepared_image> prepare_image(const A &in) {
 		auto i = std::make_shared<prep_i>(s);
-		for(size_t i0 = 0 ; i0 < s[0] ; i0++)
-			for(size_t i1 = 0 ; i1 < s[1] ; i1++)
-				i->f[i0][i1] = in[i0][i1]
-					+ (i0 > 0 ? i->f[i0 - 1][i1] : 0)
-					+ (i1 > 0 ? i->f[i0][i1 - 1] : 0)
-					- (i0 > 0 && i1 > 0 ? i->f[i0 - 1][i1 - 1] : 0);
+		prepare(in.origin(), *i);
 		return i;
 	}
 
+	virtual void prepare_image_into(const A &in, std::shared_ptr<prepared_image> &out) {
+		prepare_into(in.origin(), out);
+	}
+
+	// prepare slices directly, avoids copying them.
+	virtual std::vector<std::shared_ptr<prepared_image>> prepare_images(const B &in) {
+		std::vector<std::shared_ptr<prepared_image>> out(in.shape()[0]);
+		for(size_t j = 0 ; j < out.size() ; j++)
+			prepare_into(in[j].origin(), out[j]);
+		return out;
+	}
+
+	virtual void prepare_images_into(const B &in, B &, typename cpu_convolver<T>::images &out) {
+		out.resize(in.shape()[0]);
+		for(size_t j = 0 ; j < out.size() ; j++)
+			prepare_into(in[j].origin(), out[j]);
+	}
+
 	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t h, bool adj) {
 		return std::make_shared<prep_k>(h, adj);
 	}
 
-	virtual void conv(std::shared_ptr<prepared_image> i, std::shared_ptr<prepared_kernel> k_, A &out) {
-		const auto sat = std::dynamic_pointer_cast<prep_i>(i)->f;
-		const auto k = std::dynamic_pointer_cast<prep_k>(k_);
-		const T v = 1 / (M_SQRT2 * k->h);
-		if(k->adj) {
-			for(size_t i0 = 0 ; i0 < s[0] ; i0++)
-				for(size_t i1 = 0 ; i1 < s[1] ; i1++)
-					out[i0][i1] = v * box_sum(sat,
-						(i0 + s[0] - k->h) % s[0], (i1 + s[1] - k->h) % s[1], i0, i1);
-		} else {
-			for(size_t i0 = 0 ; i0 < s[0] ; i0++)
-				for(size_t i1 = 0 ; i1 < s[1] ; i1++)
-					out[i0][i1] = v * box_sum(sat,
-						(i0 + s[0] - 1) % s[0], (i1 + s[1] - 1) % s[1],
-						(i0 + k->h - 1) % s[0], (i1 + k->h - 1) % s[1]);
+	virtual void conv(const prepared_image &i, const prepared_kernel &k, A &out) {
+		const auto &sat = static_cast<const prep_i &>(i);
+		const auto &pk = static_cast<const prep_k &>(k);
+		#pragma omp parallel for collapse(2)
+		for(size_t t0 = 0 ; t0 < s[0] ; t0 += tile0)
+			for(size_t t1 = 0 ; t1 < s[1] ; t1 += tile1)
+				box_tile(sat, pk, out.data(), t0, t1);
+	}
+
+	// all kernels for one tile while its part of the SAT is in cache.
+	virtual void conv_all(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, B &out) {
+		const auto &sat = static_cast<const prep_i &>(i);
+		#pragma omp parallel for collapse(2)
+		for(size_t t0 = 0 ; t0 < s[0] ; t0 += tile0)
+			for(size_t t1 = 0 ; t1 < s[1] ; t1 += tile1)
+				for(size_t j = 0 ; j < ks.size() ; j++)
+					box_tile(sat, static_cast<const prep_k &>(*ks[j]), out[j].origin(), t0, t1);
+	}
+
+	// all scales in one pass over the tiles, no image is written.
+	virtual void conv_max_abs(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, A &, std::vector<T> &out) {
+		const auto &sat = static_cast<const prep_i &>(i);
+		const size_t m = ks.size();
+		out.assign(m, T(0));
+		scratch<boost::multi_array<T, 1>> maxima(this->work, 1, workspace::team(), std::array<size_t, 1>{{m}});
+		#pragma omp parallel
+		{
+			auto &mx = maxima[workspace::thread()];
+			std::fill(mx.begin(), mx.end(), T(0));
+			#pragma omp for collapse(2)
+			for(size_t t0 = 0 ; t0 < s[0] ; t0 += tile0)
+				for(size_t t1 = 0 ; t1 < s[1] ; t1 += tile1)
+					for(size_t j = 0 ; j < m ; j++)
+						tile<true>(sat, static_cast<const prep_k &>(*ks[j]), nullptr, mx[j], t0, t1);
+			#pragma omp critical(cpu_sat_convolver_max)
+			for(size_t j = 0 ; j < m ; j++)
+				out[j] = std::max(out[j], mx[j]);
+		}
+	}
+
+	// The dual update streamed row by row. Two SAT rows h apart differ by
+	// the column sums over a window of h rows, so each band of rows keeps
+	// running window sums of x and of the new y_j instead of tables, and
+	// only ys and w are written. The first h-1 rows of the adjoint need the
+	// new y_j of the band above and follow once all bands are done.
+	// adj_ks[j] has to be the adjoint of ks[j].
+	virtual void dual_update(const A &x,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks,
+		const std::vector<std::shared_ptr<prepared_kernel>> &adj_ks,
+		B &ys, const typename cpu_convolver<T>::row_update &update, A &w) {
+		const size_t s0 = s[0], s1 = s[1];
+		size_t h_max = 1;
+		for(const auto &k : ks) h_max = std::max(h_max, static_cast<const prep_k &>(*k).h);
+		const size_t band = std::max(size_t(64), 2 * h_max);
+		const size_t n_bands = (s0 + band - 1) / band;
+		const size_t team = workspace::team();
+		scratch<boost::multi_array<acc_t, 1>> wins(this->work, 0, 2 * team, std::array<size_t, 1>{{s1}});
+		scratch<boost::multi_array<T, 1>> k_xs(this->work, 0, team, std::array<size_t, 1>{{s1}});
+		#pragma omp parallel
+		{
+			const size_t t = workspace::thread();
+			auto &win_x = wins[2 * t], &win_y = wins[2 * t + 1];
+			auto &k_x = k_xs[t];
+			#pragma omp for schedule(static)
+			for(size_t b = 0 ; b < n_bands ; b++) {
+				const size_t r0 = b * band, r1 = std::min(r0 + band, s0);
+				std::fill(w[r0].origin(), w[r0].origin() + (r1 - r0) * s1, T(0));
+				for(size_t j = 0 ; j < ks.size() ; j++) {
+					const auto &k = static_cast<const prep_k &>(*ks[j]);
+					const auto &adj_k = static_cast<const prep_k &>(*adj_ks[j]);
+					const size_t h = k.h, o0 = offset(k, s0), o1 = offset(k, s1), ha = adj_k.h;
+					const T v = 1 / (M_SQRT2 * h), va = 1 / (M_SQRT2 * ha);
+					// x rows of the box for output row r0, none of the new y yet.
+					std::fill(win_x.begin(), win_x.end(), acc_t(0));
+					for(size_t d = 0 ; d < h ; d++)
+						add_row(win_x.data(), x[(r0 + o0 + d) % s0].origin(), s1, 1);
+					std::fill(win_y.begin(), win_y.end(), acc_t(0));
+					for(size_t i0 = r0 ; i0 < r1 ; i0++) {
+						row_box<false>(win_x.data(), s1, h, o1, v, k_x.data());
+						T *y = ys[j][i0].origin();
+						update(j, i0, y, k_x.data());
+						add_row(win_y.data(), y, s1, 1);
+						if(i0 >= r0 + ha)
+							add_row(win_y.data(), ys[j][i0 - ha].origin(), s1, -1);
+						if(i0 + 1 >= r0 + ha)
+							row_box<true>(win_y.data(), s1, ha, offset(adj_k, s1), va, w[i0].origin());
+						add_row(win_x.data(), x[(i0 + o0 + h) % s0].origin(), s1, 1);
+						add_row(win_x.data(), x[(i0 + o0) % s0].origin(), s1, -1);
+					}
+				}
+			}
+			// rows whose adjoint box reaches into the band above.
+			#pragma omp for schedule(static)
+			for(size_t b = 0 ; b < n_bands ; b++) {
+				const size_t r0 = b * band, r1 = std::min(r0 + band, s0);
+				for(size_t j = 0 ; j < ks.size() ; j++) {
+					const auto &adj_k = static_cast<const prep_k &>(*adj_ks[j]);
+					const size_t ha = adj_k.h, oa0 = offset(adj_k, s0), e = std::min(r1, r0 + ha - 1);
+					const T va = 1 / (M_SQRT2 * ha);
+					const auto y = ys[j];
+					std::fill(win_y.begin(), win_y.end(), acc_t(0));
+					for(size_t d = 0 ; d < ha ; d++)
+						add_row(win_y.data(), y[(r0 + oa0 + d) % s0].origin(), s1, 1);
+					for(size_t i0 = r0 ; i0 < e ; i0++) {
+						row_box<true>(win_y.data(), s1, ha, offset(adj_k, s1), va, w[i0].origin());
+						add_row(win_y.data(), y[(i0 + oa0 + ha) % s0].origin(), s1, 1);
+						add_row(win_y.data(), y[(i0 + oa0) % s0].origin(), s1, -1);
+					}
+				}
+			}
 		}
 	}
 
-	// sum of i0..j0 i1..j1 inclusive, circular.
 	private:
-	inline T box_sum(const A &sat, size_t i0, size_t i1, size_t j0, size_t j1) const {
+	typedef typename accumulator_of<T>::type acc_t;
+
+	// distance of the box start from the output index.
+	static size_t offset(const prep_k &k, size_t n) {
+		return k.adj ? (n - (k.h - 1) % n) % n : 0;
+	}
+
+	static void add_row(acc_t *acc, const T *row, size_t n, int sign) {
+		#pragma omp simd
+		for(size_t i = 0 ; i < n ; i++)
+			acc[i] += sign * acc_t(row[i]);
+	}
+
+	// out[i] = v * sum of in[(i + o + d) % n], d < h, or add that to out.
+	template<bool add>
+	static void row_box(const acc_t *in, size_t n, size_t h, size_t o, T v, T *out) {
+		acc_t acc = 0;
+		for(size_t d = 0 ; d < h ; d++) acc += in[(o + d) % n];
+		size_t a = (o + h) % n, b = o;
+		for(size_t i = 0 ; i < n ; i++) {
+			out[i] = (add ? out[i] : T(0)) + v * acc;
+			acc += in[a] - in[b];
+			if(++a == n) a = 0;
+			if(++b == n) b = 0;
+		}
+	}
+
+	// into out, reused if nothing else holds it.
+	void prepare_into(const T *in, std::shared_ptr<prepared_image> &out) {
+		if(out && out.use_count() == 1) prepare(in, static_cast<prep_i &>(*out));
+		else {
+			auto i = std::make_shared<prep_i>(s);
+			prepare(in, *i);
+			out = i;
+		}
+	}
+
+	void prepare(const T *in, prep_i &i) {
+		const size_t s0 = s[0], s1 = s[1];
+		const double scale = i.scale = acc::scale(in, s0 * s1);
+		ST *f = i.f.data();
+		// prefix sums of each row.
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+			const T *src = in + i0 * s1;
+			ST *dst = f + i0 * s1;
+			ST sum = 0, c = 0;
+			for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+				const ST x = acc::encode(src[i1], scale);
+				if(acc::exact) sum += x;
+				else {
+					const ST y = x - c, t = sum + y;
+					c = (t - sum) - y;
+					sum = t;
+				}
+				dst[i1] = sum;
+			}
+		}
+		// prefix sums of the columns, a block of columns at a time, with
+		// compensations for each column.
+		const size_t block = 1024;
+		scratch<boost::multi_array<ST, 1>> comp(this->work, 0, 1, std::array<size_t, 1>{{s1}});
+		#pragma omp parallel for
+		for(size_t b = 0 ; b < s1 ; b += block) {
+			const size_t n = std::min(block, s1 - b);
+			ST *c = comp[0].data() + b;
+			std::fill(c, c + n, ST(0));
+			for(size_t i0 = 1 ; i0 < s0 ; i0++) {
+				const ST *prev = f + (i0 - 1) * s1 + b;
+				ST *cur = f + i0 * s1 + b;
+				if(acc::exact) {
+					#pragma omp simd
+					for(size_t i1 = 0 ; i1 < n ; i1++)
+						cur[i1] += prev[i1];
+				} else {
+					#pragma omp simd
+					for(size_t i1 = 0 ; i1 < n ; i1++) {
+						const ST y = cur[i1] - c[i1], t = prev[i1] + y;
+						c[i1] = (t - prev[i1]) - y;
+						cur[i1] = t;
+					}
+				}
+			}
+		}
+	}
+
+	// tile size for the box sums.
+	static const size_t tile0 = 16, tile1 = 512;
+
+	// box sums for the tile starting at t0, t1. The box for output i covers
+	// a..a+h-1 with a = i, or a = i-h+1 for the adjoint; inside the image
+	// it takes four entries, at the borders it wraps around.
+	void box_tile(const prep_i &i, const prep_k &k, T *out, size_t t0, size_t t1) const {
+		T unused = 0;
+		tile<false>(i, k, out, unused, t0, t1);
+	}
+
+	// writes x to o[i1], or with max_abs, only its magnitude into m.
+	template<bool max_abs>
+	static void put(T *o, size_t i1, T x, T &m) {
+		if(max_abs) m = std::max(m, std::abs(x));
+		else o[i1] = x;
+	}
+
+	// box_tile, or with max_abs the largest magnitude in the tile into m.
+	template<bool max_abs>
+	void tile(const prep_i &i, const prep_k &k, T *out, T &m, size_t t0, size_t t1) const {
+		const size_t s0 = s[0], s1 = s[1], h = k.h;
+		const size_t e0 = std::min(t0 + tile0, s0), e1 = std::min(t1 + tile1, s1);
+		const ST *f = i.f.data();
+		const T v = 1 / (M_SQRT2 * h);
+		// distance of a from i.
+		const size_t d0 = k.adj ? s0 - (h - 1) % s0 : 0, d1 = k.adj ? s1 - (h - 1) % s1 : 0;
+		// columns with a1 in 1..s1-h.
+		const size_t lo1 = std::max(t1, k.adj ? h : 1), hi1 = std::min(e1, k.adj ? s1 : s1 + 1 - std::min(h, s1 + 1));
+		for(size_t i0 = t0 ; i0 < e0 ; i0++) {
+			T *o = max_abs ? nullptr : out + i0 * s1;
+			const size_t a0 = (i0 + d0) % s0;
+			if(a0 >= 1 && a0 + h <= s0 && lo1 < hi1) {
+				const ST *top = f + (a0 - 1) * s1, *bottom = f + (a0 + h - 1) * s1;
+				const size_t b1 = hi1 - lo1;
+				const ST *tl = top + (lo1 + d1) % s1 - 1, *tr = tl + h,
+					*bl = bottom + (lo1 + d1) % s1 - 1, *br = bl + h;
+				if(max_abs) {
+					T row_m = m;
+					#pragma omp simd reduction(max:row_m)
+					for(size_t i1 = 0 ; i1 < b1 ; i1++)
+						row_m = std::max(row_m, std::abs(T(v * acc::decode(br[i1] - bl[i1] - tr[i1] + tl[i1], i.scale))));
+					m = row_m;
+				} else {
+					T *ol = o + lo1;
+					#pragma omp simd
+					for(size_t i1 = 0 ; i1 < b1 ; i1++)
+						ol[i1] = v * acc::decode(br[i1] - bl[i1] - tr[i1] + tl[i1], i.scale);
+				}
+				for(size_t i1 = t1 ; i1 < lo1 ; i1++)
+					put<max_abs>(o, i1, v * wrapped_box_sum(i, a0, (i1 + d1) % s1, h), m);
+				for(size_t i1 = hi1 ; i1 < e1 ; i1++)
+					put<max_abs>(o, i1, v * wrapped_box_sum(i, a0, (i1 + d1) % s1, h), m);
+			} else {
+				for(size_t i1 = t1 ; i1 < e1 ; i1++)
+					put<max_abs>(o, i1, v * wrapped_box_sum(i, a0, (i1 + d1) % s1, h), m);
+			}
+		}
+	}
+
+	// box a0..a0+h-1, a1..a1+h-1, circular.
+	inline typename acc::value_type wrapped_box_sum(const prep_i &i, size_t a0, size_t a1, size_t h) const {
+		return acc::decode(box_sum(i.f, (a0 + s[0] - 1) % s[0], (a1 + s[1] - 1) % s[1],
+			(a0 + h - 1) % s[0], (a1 + h - 1) % s[1]), i.scale);
+	}
+
+	// sum of i0..j0 i1..j1 inclusive, circular.
+	inline ST box_sum(const AS &sat, size_t i0, size_t i1, size_t j0, size_t j1) const {
 		// corners
-		T sum = sat[i0][i1] - sat[i0][j1] - sat[j0][i1] + sat[j0][j1];
+		ST sum = sat[i0][i1] - sat[i0][j1] - sat[j0][i1] + sat[j0][j1];
 		// projections to bottom
 		if(i0 > j0)	sum += sat[s[0]-1][j1] - sat[s[0]-1][i1];
 		if(i1 > j1) {
@@ -329,5 +1360,175 @@ struct cpu_sat_convolver : cpu_convolver<T> {
 
 
 
+/**
+ * Box sums as a horizontal then a vertical circular running sum.
+ * Cost and accuracy don't depend on the box size, the sums accumulate in at
+ * least double precision.
+ */
+template<class T>
+struct cpu_separable_box_convolver : cpu_copying_convolver<T> {
+	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T, 3> B;
+	typedef typename cpu_copying_convolver<T>::prep_i prep_i;
+	typedef typename accumulator_of<T>::type acc_t;
+
+	struct prep_k : prepared_kernel {
+		size_t h;
+		bool adj;
+		prep_k(size_t h, bool adj) : h(h), adj(adj) {}
+	};
+
+	const size2_t s;
+
+	cpu_separable_box_convolver(size2_t s)
+	: s(s) {}
+
+	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t h, bool adj) {
+		return std::make_shared<prep_k>(h, adj);
+	}
+
+	virtual void conv(const prepared_image &i, const prepared_kernel &k, A &out) {
+		box_conv(static_cast<const prep_i &>(i).f, static_cast<const prep_k &>(k), out.data());
+	}
+
+	virtual void conv_all(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, B &out) {
+		const auto &in = static_cast<const prep_i &>(i).f;
+		#pragma omp parallel for
+		for(size_t j = 0 ; j < ks.size() ; j++)
+			box_conv(in, static_cast<const prep_k &>(*ks[j]), out[j].origin());
+	}
+
+	private:
+	// out[i0][i1] = sum of in[i0 + o0 + d0][i1 + o1 + d1], d < h, circular,
+	// with o = 0, or o = 1 - h for the adjoint.
+	void box_conv(const A &in, const prep_k &k, T *out) const {
+		const size_t s0 = s[0], s1 = s[1], h = k.h;
+		const size_t o0 = k.adj ? (s0 - (h - 1) % s0) % s0 : 0;
+		const size_t o1 = k.adj ? (s1 - (h - 1) % s1) % s1 : 0;
+		const T v = 1 / (M_SQRT2 * h);
+		// horizontal running sums, one row per step.
+		scratch<A> rs(this->work, 0, 1, s);
+		A &r = rs[0];
+		#pragma omp parallel for
+		for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+			const T *row = in.data() + i0 * s1;
+			T *r_row = r.data() + i0 * s1;
+			acc_t acc = 0;
+			for(size_t d = 0 ; d < h ; d++) acc += row[(o1 + d) % s1];
+			size_t add = (o1 + h) % s1, sub = o1;
+			for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+				r_row[i1] = acc;
+				acc += acc_t(row[add]) - acc_t(row[sub]);
+				if(++add == s1) add = 0;
+				if(++sub == s1) sub = 0;
+			}
+		}
+		// vertical running sums, vectorized along the rows.
+		const size_t block = 256;
+		scratch<boost::multi_array<acc_t, 1>> accs(this->work, 0, workspace::team(), std::array<size_t, 1>{{block}});
+		#pragma omp parallel
+		{
+			acc_t *acc = accs[workspace::thread()].data();
+			#pragma omp for
+			for(size_t b = 0 ; b < s1 ; b += block) {
+				const size_t e = std::min(b + block, s1);
+				std::fill(acc, acc + (e - b), acc_t(0));
+				for(size_t d = 0 ; d < h ; d++) {
+					const T *r_row = r.data() + ((o0 + d) % s0) * s1;
+					for(size_t i1 = b ; i1 < e ; i1++) acc[i1 - b] += r_row[i1];
+				}
+				size_t add = (o0 + h) % s0, sub = o0;
+				for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+					T *o_row = out + i0 * s1;
+					const T *a_row = r.data() + add * s1, *s_row = r.data() + sub * s1;
+					for(size_t i1 = b ; i1 < e ; i1++) {
+						o_row[i1] = v * acc[i1 - b];
+						acc[i1 - b] += acc_t(a_row[i1]) - acc_t(s_row[i1]);
+					}
+					if(++add == s0) add = 0;
+					if(++sub == s0) sub = 0;
+				}
+			}
+		}
+	}
+};
+
+
+
+/**
+ * Box sums straight from the definition, h rows then h columns per output,
+ * vectorized along the rows. Cheapest for the smallest boxes.
+ */
+template<class T>
+struct cpu_direct_box_convolver : cpu_copying_convolver<T> {
+	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T, 3> B;
+	typedef typename cpu_copying_convolver<T>::prep_i prep_i;
+
+	struct prep_k : prepared_kernel {
+		size_t h;
+		bool adj;
+		prep_k(size_t h, bool adj) : h(h), adj(adj) {}
+	};
+
+	const size2_t s;
+	// largest box prepared so far, for the size of the scratch rows.
+	size_t h_max = 1;
+
+	cpu_direct_box_convolver(size2_t s)
+	: s(s) {}
+
+	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t h, bool adj) {
+		h_max = std::max(h_max, h);
+		return std::make_shared<prep_k>(h, adj);
+	}
+
+	virtual void conv(const prepared_image &i, const prepared_kernel &k, A &out) {
+		box_conv(static_cast<const prep_i &>(i).f, static_cast<const prep_k &>(k), out.data());
+	}
+
+	private:
+	// out[i0][i1] = sum of in[i0 + o0 + d0][i1 + o1 + d1], d < h, circular,
+	// with o = 0, or o = 1 - h for the adjoint.
+	void box_conv(const A &in, const prep_k &k, T *out) const {
+		const size_t s0 = s[0], s1 = s[1], h = k.h;
+		const size_t o0 = k.adj ? (s0 - (h - 1) % s0) % s0 : 0;
+		const size_t o1 = k.adj ? (s1 - (h - 1) % s1) % s1 : 0;
+		const T v = 1 / (M_SQRT2 * h);
+		// column sums, then extended by h - 1 wrapped columns.
+		const size_t team = workspace::team();
+		scratch<boost::multi_array<T, 1>> rows(this->work, 0, 2 * team, std::array<size_t, 1>{{s1 + h_max - 1}});
+		#pragma omp parallel
+		{
+			const size_t t = workspace::thread();
+			T *col = rows[2 * t].data(), *ext = rows[2 * t + 1].data();
+			#pragma omp for
+			for(size_t i0 = 0 ; i0 < s0 ; i0++) {
+				std::fill(col, col + s1, T(0));
+				for(size_t d0 = 0 ; d0 < h ; d0++) {
+					const T *row = in.data() + ((i0 + o0 + d0) % s0) * s1;
+					#pragma omp simd
+					for(size_t i1 = 0 ; i1 < s1 ; i1++)
+						col[i1] += row[i1];
+				}
+				for(size_t c = 0 ; c < s1 + h - 1 ; c++)
+					ext[c] = col[(o1 + c) % s1];
+				T *o = out + i0 * s1;
+				std::fill(o, o + s1, T(0));
+				for(size_t d1 = 0 ; d1 < h ; d1++) {
+					const T *e = ext + d1;
+					#pragma omp simd
+					for(size_t i1 = 0 ; i1 < s1 ; i1++)
+						o[i1] += e[i1];
+				}
+				#pragma omp simd
+				for(size_t i1 = 0 ; i1 < s1 ; i1++)
+					o[i1] *= v;
+			}
+		}
+	}
+};
+
 
 #endif
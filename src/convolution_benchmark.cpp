@@ -1,7 +1,10 @@
 #include <iostream>
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <omp.h>
 #include "constraint_parser.h"
 #include "convolution.h"
+#include "hybrid_convolver.h"
 #include "multi_array_operators.h"
 
 using namespace std;
@@ -12,6 +15,8 @@ typedef float T;
 typedef multi_array<T, 2> A;
 
 size_t runs = 10;
+// largest box, for the padded FFT.
+size_t pad_box = 1;
 
 vex::Context ctx(vex::Filter::Count(1));
 
@@ -35,7 +40,7 @@ void conv(size_t sz, const typename Conv::A &x, typename Conv::A &y, size_t h) {
 		w_img.toc();
 
 		w_conv.tic();
-		c->conv(i, k, y);
+		c->conv(*i, *k, y);
 		ctx.queue()[0].finish();
 		w_conv.toc();
 
@@ -48,6 +53,11 @@ void conv(size_t sz, const typename Conv::A &x, typename Conv::A &y, size_t h) {
 		  << '\t' << (s / w_total.average());
 }
 
+// the FFT on sizes padded to 2^a 3^b 5^c 7^d.
+struct cpu_padded_fft_convolver : cpu_fft_convolver<T> {
+	cpu_padded_fft_convolver(size2_t s) : cpu_fft_convolver<T>(s, 1, pad_box) {}
+};
+
 template<class Conv>
 void bench_cpu(size_t sz, size_t hs) {
 	multi_array<T, 2> x(extents[sz][sz]), y(x);
@@ -66,6 +76,103 @@ void bench_gpu(size_t sz, size_t hs) {
 	}
 }
 
+// seconds per pixel of the parts of one solver step, see convolver_costs.
+template<class Conv>
+convolver_costs::cost calibrate(size_t sz) {
+	auto c = make_shared<Conv>(size2_t{{sz, sz}});
+	A x(extents[sz][sz]), y(x);
+	for(auto r : x) for(auto &v : r) v = 2.0 * rand() / RAND_MAX - 1;
+	const size_t h0 = 2, h1 = min<size_t>(16, sz);
+	auto k0 = c->prepare_kernel(h0, false), k1 = c->prepare_kernel(h1, false);
+	auto adj_k = c->prepare_kernel(h0, true);
+	vex::stopwatch<> w_prep, w_conv0, w_conv1, w_sum1, w_sum4;
+	for(size_t ir = 0 ; ir < runs ; ir++) {
+		w_prep.tic();
+		auto i = c->prepare_image(x);
+		w_prep.toc();
+
+		w_conv0.tic();
+		c->conv(*i, *k0, y);
+		w_conv0.toc();
+
+		w_conv1.tic();
+		c->conv(*i, *k1, y);
+		w_conv1.toc();
+
+		w_sum1.tic();
+		c->conv_sum({i}, {adj_k}, y);
+		w_sum1.toc();
+
+		w_sum4.tic();
+		c->conv_sum({i, i, i, i}, {adj_k, adj_k, adj_k, adj_k}, y);
+		w_sum4.toc();
+	}
+	const double n = sz * sz;
+	convolver_costs::cost r;
+	r.prep = w_prep.average() / n;
+	r.conv1 = h1 > h0 ? max(0.0, (w_conv1.average() - w_conv0.average()) / n / (h1 - h0)) : 0;
+	r.conv0 = max(0.0, w_conv0.average() / n - r.conv1 * h0);
+	const double per_image = (w_sum4.average() - w_sum1.average()) / n / 3;
+	r.sum1 = max(0.0, per_image - r.conv1 * h0);
+	r.sum0 = max(0.0, w_sum1.average() / n - per_image);
+	return r;
+}
+
+/**
+ * Seconds per solver step of the FFT convolutions with m scales: batched,
+ * each transform on all cores, and per constraint as the solver did
+ * before, each thread convolving and preparing its own y_i with
+ * one-thread transforms and adding to w.
+ */
+void bench_batch(size_t sz, size_t m, size_t h_max) {
+	typedef multi_array<T, 3> B;
+	const size2_t s{{sz, sz}};
+	cpu_fft_convolver<T> c(s, omp_get_max_threads());
+	c.use_workspace(std::make_shared<workspace>());
+	vector<std::shared_ptr<prepared_kernel>> ks, adj_ks;
+	for(size_t j = 0 ; j < m ; j++) {
+		ks.push_back(c.prepare_kernel(1 + j % h_max, false));
+		adj_ks.push_back(c.prepare_kernel(1 + j % h_max, true));
+	}
+	A x(s), w(s);
+	for(auto r : x) for(auto &v : r) v = 2.0 * rand() / RAND_MAX - 1;
+	B ys(extents[m][sz][sz]);
+	std::shared_ptr<prepared_image> f_x;
+	vector<std::shared_ptr<prepared_image>> f_ys;
+	vex::stopwatch<> w_batch, w_loop;
+	for(size_t ir = 0 ; ir <= runs ; ir++) {
+		// the first run plans.
+		if(ir > 0) w_batch.tic();
+		c.prepare_image_into(x, f_x);
+		c.conv_all(*f_x, ks, ys);
+		c.prepare_images_into(ys, ys, f_ys);
+		c.conv_sum(f_ys, adj_ks, w);
+		if(ir > 0) w_batch.toc();
+
+		if(ir > 0) w_loop.tic();
+		c.prepare_image_into(x, f_x);
+		mimas::fill(w, 0);
+		#pragma omp parallel
+		{
+			A k_x(s);
+			#pragma omp for
+			for(size_t j = 0 ; j < m ; j++) {
+				c.conv(*f_x, *ks[j], k_x);
+				c.conv(*c.prepare_image(k_x), *adj_ks[j], k_x);
+				#pragma omp critical(bench_batch)
+				{
+					using namespace mimas;
+					w += k_x;
+				}
+			}
+		}
+		if(ir > 0) w_loop.toc();
+	}
+	cout << sz << '\t' << m << '\t' << omp_get_max_threads()
+	     << '\t' << w_batch.average() << '\t' << w_loop.average()
+	     << '\t' << (w_loop.average() / w_batch.average()) << endl;
+}
+
 void bench_gpu_lin(size_t sz) {
 	try {
 		vex::vector<T> x(sz * sz);
@@ -90,7 +197,10 @@ void bench_gpu_lin(size_t sz) {
 int main(int argc, char **argv) {
 	options_description desc("Options");
 	sizes_t sizes{128}, hs{4};
-	bool run_gpu = true, run_cpu = true, run_fft = true, run_sat = true;
+	bool run_gpu = true, run_cpu = true, run_fft = true, run_sat = true, run_sep = true, run_dir = true, run_tiled = true;
+	bool run_padded = false, awkward = false, calibrate_costs = false, batch = false;
+	sizes_t scales;
+	string sat_acc = "float", costs_path = convolver_costs::default_path();
 	desc.add_options()
 		("help", "show help")
 		("size", value(&sizes), "list of sizes to try.")
@@ -99,7 +209,20 @@ int main(int argc, char **argv) {
 		("cpu", value(&run_cpu), "use cpu")
 		("fft", value(&run_fft), "use fft")
 		("sat", value(&run_sat), "use sat")
-		("runs", value(&runs), "run multiple times");
+		("sep", value(&run_sep), "use separable running sums")
+		("dir", value(&run_dir), "use direct box sums")
+		("tiled", value(&run_tiled), "use fft on 512x512 tiles")
+		("padded", value(&run_padded), "use fft on sizes padded to 2^a 3^b 5^c 7^d")
+		("awkward", bool_switch(&awkward), "try sizes with large prime factors instead of --size, with --padded")
+		("sat-acc", value(&sat_acc)->default_value(sat_acc), "CPU SAT accumulator: float, double or fixed")
+		("runs", value(&runs), "run multiple times")
+		("fft-planning", value<string>()->default_value("measure")
+			->notifier([](const string &l){ fftw::config().level = fftw::parse_level(l); }),
+			"FFTW planning rigor: estimate, measure, patient or exhaustive")
+		("calibrate", bool_switch(&calibrate_costs), "measure the CPU convolvers at the first size and save their costs for --hybrid")
+		("costs", value(&costs_path)->default_value(costs_path), "file for the calibrated costs")
+		("batch", bool_switch(&batch), "compare the batched CPU FFTs of a solver step with convolving per constraint")
+		("scales", value(&scales), "list of numbers of scales for --batch, default: the cores and twice as many");
 	variables_map vm;
 	store(parse_command_line(argc, argv, desc), vm);
 	notify(vm);
@@ -109,11 +232,47 @@ int main(int argc, char **argv) {
 	}
 
 	vex::StaticContext<>::set(ctx);
+	pad_box = *max_element(hs.begin(), hs.end());
+	if(awkward) {
+		sizes = vector<size_t>{251, 509, 766, 1021, 1202, 1531, 2039};
+		run_padded = true;
+	}
+
+	if(calibrate_costs) {
+		const size_t sz = sizes[0];
+		convolver_costs costs;
+		costs.c[convolver_costs::direct] = calibrate<cpu_direct_box_convolver<T>>(sz);
+		costs.c[convolver_costs::separable] = calibrate<cpu_separable_box_convolver<T>>(sz);
+		costs.c[convolver_costs::sat] = calibrate<cpu_sat_convolver<T, accumulator_of<T>::type>>(sz);
+		costs.c[convolver_costs::fft] = calibrate<cpu_fft_convolver<T>>(sz);
+		const auto dir = filesystem::path(costs_path).parent_path();
+		if(!dir.empty()) filesystem::create_directories(dir);
+		costs.save(costs_path);
+		cout << "costs for " << sz << 'x' << sz << " saved to " << costs_path << endl;
+		for(auto h : hs)
+			cout << h << '\t' << convolver_costs::name(costs.choose({h})[0]) << endl;
+		return EXIT_SUCCESS;
+	}
+
+	if(batch) {
+		const size_t cores = omp_get_max_threads();
+		if(scales.empty()) scales = sizes_t{cores, 2 * cores};
+		cout << "size\tscales\tthreads\tbatched\tperconstraint\tspeedup" << endl;
+		for(auto sz : sizes)
+			for(auto m : scales)
+				bench_batch(sz, m, pad_box);
+		return EXIT_SUCCESS;
+	}
 
 	cout << "size\tbox";
 	if(run_gpu && run_fft) cout << "\tgpufftkprep\tgpufftiprep\tgpufftconv\tgpuffttotal";
 	if(run_gpu && run_sat) cout << "\tgpusatkprep\tgpusatiprep\tgpusatconv\tgpusattotal";
 	if(run_cpu && run_fft) cout << "\tcpufftkprep\tcpufftiprep\tcpufftconv\tcpuffttotal";
+	if(run_cpu && run_sat) cout << "\tcpusatkprep\tcpusatiprep\tcpusatconv\tcpusattotal";
+	if(run_cpu && run_sep) cout << "\tcpusepkprep\tcpusepiprep\tcpusepconv\tcpuseptotal";
+	if(run_cpu && run_dir) cout << "\tcpudirkprep\tcpudiriprep\tcpudirconv\tcpudirtotal";
+	if(run_cpu && run_tiled) cout << "\tcputilekprep\tcputileiprep\tcputileconv\tcputiletotal";
+	if(run_cpu && run_padded) cout << "\tcpupadkprep\tcpupadiprep\tcpupadconv\tcpupadtotal";
 	if(run_gpu           ) cout << "\tgpulin";
 	cout << endl;
 
@@ -123,6 +282,15 @@ int main(int argc, char **argv) {
 			if(run_gpu && run_fft) bench_gpu<gpu_fft_convolver<T>>(sz, h);
 			if(run_gpu && run_sat) bench_gpu<gpu_sat_convolver<T>>(sz, h);
 			if(run_cpu && run_fft) bench_cpu<cpu_fft_convolver<T>>(sz, h);
+			if(run_cpu && run_sat) {
+				if(sat_acc == "double") bench_cpu<cpu_sat_convolver<T, double>>(sz, h);
+				else if(sat_acc == "fixed") bench_cpu<cpu_sat_convolver<T, int64_t>>(sz, h);
+				else bench_cpu<cpu_sat_convolver<T>>(sz, h);
+			}
+			if(run_cpu && run_sep) bench_cpu<cpu_separable_box_convolver<T>>(sz, h);
+			if(run_cpu && run_dir) bench_cpu<cpu_direct_box_convolver<T>>(sz, h);
+			if(run_cpu && run_tiled) bench_cpu<cpu_tiled_fft_convolver<T>>(sz, h);
+			if(run_cpu && run_padded) bench_cpu<cpu_padded_fft_convolver>(sz, h);
 			if(run_gpu           ) bench_gpu_lin(sz);
 			cout << endl;
 		}
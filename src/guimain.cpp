@@ -657,6 +657,25 @@ struct app_t : Gtk::Application {
 			"Use FFT for convolution (default for CPU)");
 		main_desc.add_options()("sat", value(&p->use_fft)->implicit_value(false)->zero_tokens(),
 			"Use SAT for convolution (default for GPU)");
+		main_desc.add_options()("separable", bool_switch(&p->use_separable)->notifier([=](bool s){ if(s) p->use_fft = false; }),
+			"Use separable running sums for convolution (CPU only)");
+		main_desc.add_options()("fft-threads", value(&p->fft_threads)->value_name("<int>"),
+			"Threads for each FFT, default: all cores (CPU only)");
+		main_desc.add_options()("fft-tile", value(&p->fft_tile),
+			"Use FFT on tiles of this size for large images (CPU only)");
+		main_desc.add_options()("fft-pad", bool_switch(&p->fft_pad),
+			"Pad sizes with large prime factors to sizes the FFT is fast on (CPU only)");
+		main_desc.add_options()("fft-in-place", bool_switch(&p->fft_in_place),
+			"Transform in place to save memory (CPU only)");
+		main_desc.add_options()("hybrid", bool_switch(&p->use_hybrid),
+			"Choose the convolution for each box size, see convolution_benchmark --calibrate (CPU only)");
+		main_desc.add_options()("fft-planning", value<string>()->default_value("measure")->value_name("<level>")
+				->notifier([](const string &l){ fftw::config().level = fftw::parse_level(l); }),
+			"FFTW planning rigor: estimate, measure, patient or exhaustive");
+		main_desc.add_options()("fft-wisdom", value(&fftw::config().wisdom_file)->default_value("cache/fftw.wisdom")->value_name("<file>"),
+			"Import FFTW wisdom from and export it to this file, “” to disable");
+		main_desc.add_options()("stream", bool_switch(&p->stream_dual),
+			"Stream the dual update row by row (CPU with --sat only)");
 		options_description par_desc("Parameters");
 		par_desc.add_options()
 			("constraints,c", value(&p->kernel_sizes)->default_value(p->kernel_sizes)->value_name("<list>"),
@@ -667,6 +686,8 @@ struct app_t : Gtk::Application {
 				"Maximum number of optimization steps")
 			("tolerance,e", value(&p->tolerance)->default_value(p->tolerance)->value_name("<float>"),
 				"Stop when inverse relative change larger than this value")
+			("check-every", value(&p->check_every)->default_value(p->check_every)->value_name("<int>"),
+				"Test the tolerance every this many steps")
 			("tau,t", value(&p->tau)->default_value(p->tau)->value_name("<float>"),
 				"Step size τ (large)")
 			("sigma,s", value(&p->sigma)->default_value(p->sigma)->value_name("<float>"),
@@ -686,6 +707,15 @@ struct app_t : Gtk::Application {
 				"Don't use a cached value for q")
 			("mc-steps", value(&p->monte_carlo_steps)->default_value(p->monte_carlo_steps)->value_name("<int>"),
 				"Number of monte carlo simulations to use for q")
+			("mc-seed", value(&p->mc_seed)->default_value(p->mc_seed)->value_name("<int>"),
+				"Seed of the monte carlo simulations, 0 for a random one")
+			("mc-tolerance", value(&p->mc_tolerance)->default_value(p->mc_tolerance)->value_name("<float>"),
+				"Run monte carlo simulations until the 95% interval of q is within this relative half-width, "
+				"at most mc-steps of them, 0 to run all")
+			("cache-dir", value(&p->cache_dir)->default_value(p->cache_dir)->value_name("<dir>"),
+				"Directory of simulated values of q, shared by processes")
+			("cache-limit", value(&p->cache_limit)->default_value(p->cache_limit)->value_name("<MiB>"),
+				"Size of the cache of q, least recently used ones are removed above it, 0 for no limit")
 			("dump-mc", bool_switch(&p->dump_mc),
 				"Dump all simulation data");
 
@@ -704,6 +734,8 @@ struct app_t : Gtk::Application {
 			cerr << desc << endl;
 			return EXIT_FAILURE;
 		}
+		const auto wisdom_dir = boost::filesystem::path(fftw::config().wisdom_file).parent_path();
+		if(!wisdom_dir.empty()) boost::filesystem::create_directories(wisdom_dir);
 
 		// GUI
 		if(output_file.empty()) {
@@ -0,0 +1,290 @@
+#ifndef __HYBRID_CONVOLVER_H__
+#define __HYBRID_CONVOLVER_H__
+
+#include "convolution.h"
+#include <array>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <stdexcept>
+
+/**
+ * Cost of the CPU convolvers, in seconds per pixel, for one step of the
+ * solver: prepare an image, convolve it with a box of size h, and sum up
+ * convolutions of several images.
+ * Calibrated on the host with `convolution_benchmark --calibrate`.
+ */
+struct convolver_costs {
+	enum kind { direct, separable, sat, fft, count };
+
+	struct cost {
+		// prepare_image, conv = conv0 + conv1 h,
+		// conv_sum = sum0 + sum1 + conv1 h per image.
+		double prep, conv0, conv1, sum0, sum1;
+	};
+
+	// rough defaults, used until calibrated.
+	std::array<cost, count> c{{
+		{0.2e-9, 0.5e-9, 0.6e-9, 0, 0.8e-9},
+		{0.2e-9, 4e-9, 0, 0, 4.5e-9},
+		{2e-9, 1.5e-9, 0, 0, 2e-9},
+		{12e-9, 3e-9, 0, 10e-9, 1e-9}
+	}};
+
+	static const char *name(size_t k) {
+		static const char *names[count] = {"direct", "separable", "sat", "fft"};
+		return names[k];
+	}
+
+	static std::string default_path() {
+		return "cache/convolvers.dat";
+	}
+
+	// cost of one image with a box of size h, once for each step.
+	double per_kernel(size_t k, size_t h) const {
+		return c[k].prep + c[k].conv0 + c[k].sum1 + 2 * c[k].conv1 * h;
+	}
+
+	// cost once for each step, if any kernel uses k.
+	double shared(size_t k) const {
+		return c[k].prep + c[k].sum0;
+	}
+
+	// cheapest convolver for each size, with the shared costs of all
+	// convolvers used.
+	std::vector<size_t> choose(const std::vector<size_t> &hs) const {
+		std::vector<size_t> best(hs.size(), sat), choice(hs.size());
+		double best_cost = std::numeric_limits<double>::infinity();
+		for(size_t used = 1 ; used < (1 << count) ; used++) {
+			double total = 0;
+			for(size_t k = 0 ; k < count ; k++)
+				if(used & (1 << k)) total += shared(k);
+			for(size_t j = 0 ; j < hs.size() ; j++) {
+				double min = std::numeric_limits<double>::infinity();
+				for(size_t k = 0 ; k < count ; k++)
+					if((used & (1 << k)) && per_kernel(k, hs[j]) < min) {
+						min = per_kernel(k, hs[j]);
+						choice[j] = k;
+					}
+				total += min;
+			}
+			if(total < best_cost) {
+				best_cost = total;
+				best = choice;
+			}
+		}
+		return best;
+	}
+
+	bool load(const std::string &path = default_path()) {
+		std::ifstream f(path);
+		if(!f) return false;
+		std::string line;
+		while(getline(f, line)) {
+			if(line.empty() || line[0] == '#') continue;
+			std::istringstream ss(line);
+			std::string n;
+			cost x;
+			if(!(ss >> n >> x.prep >> x.conv0 >> x.conv1 >> x.sum0 >> x.sum1))
+				throw std::runtime_error("invalid convolver costs in " + path);
+			for(size_t k = 0 ; k < count ; k++)
+				if(n == name(k)) c[k] = x;
+		}
+		return true;
+	}
+
+	void save(const std::string &path = default_path()) const {
+		std::ofstream f(path);
+		f << "# convolver prep conv0 conv1 sum0 sum1, seconds per pixel\n";
+		for(size_t k = 0 ; k < count ; k++)
+			f << name(k) << ' ' << c[k].prep << ' ' << c[k].conv0 << ' ' << c[k].conv1
+			  << ' ' << c[k].sum0 << ' ' << c[k].sum1 << '\n';
+	}
+};
+
+
+/**
+ * Picks a CPU convolver for each kernel size from the cost model.
+ * Images are prepared for all convolvers that any kernel uses, so the
+ * kernels have to be prepared first.
+ */
+template<class T>
+struct hybrid_convolver : cpu_convolver<T> {
+	typedef boost::multi_array<T, 2> A;
+	typedef boost::multi_array<T, 3> B;
+	static const size_t count = convolver_costs::count;
+
+	struct prep_i : prepared_image {
+		std::array<std::shared_ptr<prepared_image>, count> f;
+	};
+
+	struct prep_k : prepared_kernel {
+		size_t conv;
+		std::shared_ptr<prepared_kernel> k;
+		prep_k(size_t conv, std::shared_ptr<prepared_kernel> k) : conv(conv), k(k) {}
+	};
+
+	const size2_t s;
+	convolver_costs costs;
+	std::array<std::shared_ptr<cpu_convolver<T>>, count> convs;
+	std::array<bool, count> used;
+	// choice for the planned kernel sizes.
+	std::map<size_t, size_t> planned;
+
+	// threads for each transform of the FFT convolver, whose share of the
+	// kernels is transformed as one batch outside of parallel regions.
+	hybrid_convolver(size2_t s, const convolver_costs &costs, int threads = 1)
+	: s(s), costs(costs) {
+		convs[convolver_costs::direct] = std::make_shared<cpu_direct_box_convolver<T>>(s);
+		convs[convolver_costs::separable] = std::make_shared<cpu_separable_box_convolver<T>>(s);
+		convs[convolver_costs::sat] = std::make_shared<cpu_sat_convolver<T, typename accumulator_of<T>::type>>(s);
+		convs[convolver_costs::fft] = std::make_shared<cpu_fft_convolver<T>>(s, threads);
+		used.fill(false);
+	}
+
+	// with the calibrated costs if there are any.
+	hybrid_convolver(size2_t s, int threads = 1)
+	: hybrid_convolver(s, load_costs(), threads) {}
+
+	virtual void use_workspace(std::shared_ptr<workspace> w) {
+		this->work = w;
+		for(auto &c : convs) c->use_workspace(w);
+	}
+
+	virtual void plan(const std::vector<size_t> &hs) {
+		const auto choice = costs.choose(hs);
+		planned.clear();
+		used.fill(false);
+		for(size_t j = 0 ; j < hs.size() ; j++)
+			planned[hs[j]] = choice[j];
+	}
+
+	virtual std::shared_ptr<prepared_kernel> prepare_kernel(size_t h, bool adj) {
+		size_t k;
+		auto p = planned.find(h);
+		if(p != planned.end()) k = p->second;
+		else k = costs.choose({h})[0];
+		used[k] = true;
+		return std::make_shared<prep_k>(k, convs[k]->prepare_kernel(h, adj));
+	}
+
+	virtual std::shared_ptr<prepared_image> prepare_image(const A &in) {
+		auto i = std::make_shared<prep_i>();
+		for(size_t k = 0 ; k < count ; k++)
+			if(used[k]) i->f[k] = convs[k]->prepare_image(in);
+		return i;
+	}
+
+	virtual void prepare_image_into(const A &in, std::shared_ptr<prepared_image> &out) {
+		if(!out || out.use_count() != 1) out = std::make_shared<prep_i>();
+		auto &i = static_cast<prep_i &>(*out);
+		for(size_t k = 0 ; k < count ; k++)
+			if(used[k]) convs[k]->prepare_image_into(in, i.f[k]);
+	}
+
+	virtual std::vector<std::shared_ptr<prepared_image>> prepare_images(const B &in) {
+		std::vector<std::shared_ptr<prepared_image>> out(in.shape()[0]);
+		for(auto &i : out) i = std::make_shared<prep_i>();
+		for(size_t k = 0 ; k < count ; k++) {
+			if(!used[k]) continue;
+			const auto f = convs[k]->prepare_images(in);
+			for(size_t j = 0 ; j < out.size() ; j++)
+				static_cast<prep_i &>(*out[j]).f[k] = f[j];
+		}
+		return out;
+	}
+
+	// the images of each convolver are moved out of out and back, so it
+	// can reuse what nothing else holds.
+	virtual void prepare_images_into(const B &in, B &storage, typename cpu_convolver<T>::images &out) {
+		const size_t m = in.shape()[0];
+		out.resize(m);
+		for(auto &i : out)
+			if(!i || i.use_count() != 1) i = std::make_shared<prep_i>();
+		for(size_t k = 0 ; k < count ; k++) {
+			if(!used[k]) continue;
+			sub_is.resize(m);
+			for(size_t j = 0 ; j < m ; j++)
+				sub_is[j] = std::move(static_cast<prep_i &>(*out[j]).f[k]);
+			convs[k]->prepare_images_into(in, storage, sub_is);
+			for(size_t j = 0 ; j < m ; j++)
+				static_cast<prep_i &>(*out[j]).f[k] = std::move(sub_is[j]);
+		}
+		sub_is.clear();
+	}
+
+	virtual void conv(const prepared_image &i, const prepared_kernel &k, A &out) {
+		const auto &pk = static_cast<const prep_k &>(k);
+		convs[pk.conv]->conv(image(i, pk.conv), *pk.k, out);
+	}
+
+	// each convolver gets its share of the kernels as one batch, into a
+	// scratch batch with room for all of them unless it has all.
+	virtual void conv_all(const prepared_image &i,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, B &out) {
+		for(size_t k = 0 ; k < count ; k++) {
+			split(ks, k);
+			if(js.empty()) continue;
+			if(js.size() == ks.size()) {
+				convs[k]->conv_all(image(i, k), sub_ks, out);
+				continue;
+			}
+			scratch<B> temp(this->work, 3, 1, std::array<size_t, 3>{{ks.size(), s[0], s[1]}});
+			convs[k]->conv_all(image(i, k), sub_ks, temp[0]);
+			for(size_t n = 0 ; n < js.size() ; n++)
+				out[js[n]] = temp[0][n];
+		}
+		sub_ks.clear();
+	}
+
+	virtual void conv_sum(const std::vector<std::shared_ptr<prepared_image>> &is,
+		const std::vector<std::shared_ptr<prepared_kernel>> &ks, A &out) {
+		using namespace mimas;
+		fill(out, 0);
+		scratch<A> temp(this->work, 3, 1, s);
+		for(size_t k = 0 ; k < count ; k++) {
+			split(ks, k);
+			if(js.empty()) continue;
+			sub_is.clear();
+			for(auto j : js) sub_is.push_back(static_cast<const prep_i &>(*is[j]).f[k]);
+			convs[k]->conv_sum(sub_is, sub_ks, temp[0]);
+			out += temp[0];
+		}
+		// the images may be reused once nothing else holds them.
+		sub_is.clear();
+		sub_ks.clear();
+	}
+
+	private:
+	static convolver_costs load_costs() {
+		convolver_costs c;
+		c.load();
+		return c;
+	}
+
+	static const prepared_image &image(const prepared_image &i, size_t k) {
+		const auto &f = static_cast<const prep_i &>(i).f[k];
+		if(!f) throw std::logic_error("image prepared before its kernels");
+		return *f;
+	}
+
+	// operands of each convolver, kept to reuse their capacity.
+	std::vector<size_t> js;
+	std::vector<std::shared_ptr<prepared_kernel>> sub_ks;
+	typename cpu_convolver<T>::images sub_is;
+
+	// js and sub_ks: indices and inner kernels of the kernels using convolver k.
+	void split(const std::vector<std::shared_ptr<prepared_kernel>> &ks, size_t k) {
+		js.clear();
+		sub_ks.clear();
+		for(size_t j = 0 ; j < ks.size() ; j++) {
+			const auto &pk = static_cast<const prep_k &>(*ks[j]);
+			if(pk.conv != k) continue;
+			js.push_back(j);
+			sub_ks.push_back(pk.k);
+		}
+	}
+};
+
+#endif
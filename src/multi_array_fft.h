@@ -1,21 +1,223 @@
 #ifndef __MULTI_ARRAY_FFT_H__
 #define __MULTI_ARRAY_FFT_H__
 
+#include "config.h"
 extern "C" {
 #include <fftw3.h>
 }
 #include <boost/multi_array.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 #include <array>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <functional>
+#include <fstream>
 #include <stdexcept>
 #include <complex>
+#include <type_traits>
 
 namespace fftw {
 
 enum dir_t { forward, inverse };
 
+// planning rigor: faster planning or faster transforms.
+enum level_t { estimate, measure, patient, exhaustive };
+
+inline unsigned int level_flags(level_t level) {
+	switch(level) {
+	case estimate: return FFTW_ESTIMATE;
+	case patient: return FFTW_PATIENT;
+	case exhaustive: return FFTW_EXHAUSTIVE;
+	default: return FFTW_MEASURE;
+	}
+}
+
+inline level_t parse_level(const std::string &name) {
+	if(name == "estimate") return estimate;
+	if(name == "measure") return measure;
+	if(name == "patient") return patient;
+	if(name == "exhaustive") return exhaustive;
+	throw std::invalid_argument("unknown FFTW planning level " + name);
+}
+
+// Process-wide planning settings, used for all plans made afterwards.
+struct settings {
+	level_t level = measure;
+	// wisdom is read from and written to this file, unless empty.
+	std::string wisdom_file;
+};
+
+inline settings &config() {
+	static settings s;
+	return s;
+}
+
+// The FFTW functions for each precision, X is their prefix.
+template<class R> struct api {};
 template<class T> struct fftw_map {};
-template<> struct fftw_map<float> { typedef float type; };
-template<> struct fftw_map<std::complex<float>> { typedef fftwf_complex type; };
+
+#define FFTW_API(R, X, SUFFIX) \
+template<> struct api<R> { \
+	typedef X##_plan plan_t; \
+	typedef std::shared_ptr<std::remove_pointer<X##_plan>::type> plan_ptr; \
+	typedef X##_complex complex_t; \
+	typedef X##_r2r_kind r2r_kind_t; \
+	/* appended to the wisdom file name. */ \
+	static const char *suffix() { return SUFFIX; } \
+	template<class... A> static plan_t plan_many_dft_r2c(A... a) { return X##_plan_many_dft_r2c(a...); } \
+	template<class... A> static plan_t plan_many_dft_c2r(A... a) { return X##_plan_many_dft_c2r(a...); } \
+	template<class... A> static plan_t plan_many_dft(A... a) { return X##_plan_many_dft(a...); } \
+	template<class... A> static plan_t plan_many_r2r(A... a) { return X##_plan_many_r2r(a...); } \
+	template<class... A> static void execute_dft_r2c(A... a) { X##_execute_dft_r2c(a...); } \
+	template<class... A> static void execute_dft_c2r(A... a) { X##_execute_dft_c2r(a...); } \
+	template<class... A> static void execute_dft(A... a) { X##_execute_dft(a...); } \
+	template<class... A> static void execute_r2r(A... a) { X##_execute_r2r(a...); } \
+	static void destroy_plan(plan_t p) { X##_destroy_plan(p); } \
+	static void *malloc(size_t n) { return X##_malloc(n); } \
+	static void free(void *p) { X##_free(p); } \
+	static size_t alignment_of(R *p) { return X##_alignment_of(p); } \
+	static bool import_wisdom(const char *f) { return X##_import_wisdom_from_filename(f); } \
+	static bool export_wisdom(const char *f) { return X##_export_wisdom_to_filename(f); } \
+	THREADS_API(X) \
+}; \
+template<> struct fftw_map<R> { typedef R type; }; \
+template<> struct fftw_map<std::complex<R>> { typedef X##_complex type; };
+
+#if HAVE_FFTW_THREADS
+#define THREADS_API(X) \
+	static bool init_threads() { return X##_init_threads(); } \
+	static void plan_with_nthreads(int n) { X##_plan_with_nthreads(n); }
+#else
+#define THREADS_API(X)
+#endif
+
+FFTW_API(float, fftwf, "")
+FFTW_API(double, fftw, ".double")
+FFTW_API(long double, fftwl, ".long-double")
+
+#undef THREADS_API
+#undef FFTW_API
+
+/**
+ * Plans shared by the whole process, by precision, kind, shape, batch size,
+ * flags and alignment of the arrays. The FFTW planner isn't thread-safe, so
+ * planning and wisdom run under one lock; executing the plans is safe.
+ * Wisdom is imported before the first plan, the wisdom of new plans is
+ * saved once, when the process exits, to one file for each precision.
+ */
+class registry {
+	std::mutex mutex;
+	std::map<std::vector<long>, std::shared_ptr<void>> plans;
+	std::set<std::string> wisdom_loaded;
+	// wisdom files with new plans, and how to save them.
+	std::map<std::string, void (*)(const std::string &)> unsaved;
+
+	static registry &instance() {
+		static registry r;
+		return r;
+	}
+
+	~registry() {
+		for(auto &u : unsaved) u.second(u.first);
+	}
+
+	template<class R>
+	static std::string wisdom_file() {
+		const auto &file = config().wisdom_file;
+		return file.empty() ? file : file + api<R>::suffix();
+	}
+
+	template<class R>
+	void load_wisdom() {
+		const auto file = wisdom_file<R>();
+		if(file.empty() || wisdom_loaded.count(file)) return;
+		api<R>::import_wisdom(file.c_str());
+		wisdom_loaded.insert(file);
+	}
+
+	// merges into file under a lock between processes: the wisdom others
+	// saved meanwhile is imported, all of it written under a unique name
+	// and renamed over file. Best effort, failures leave it as it was.
+	template<class R>
+	static void save_wisdom(const std::string &file) {
+		using namespace boost::interprocess;
+		boost::system::error_code ec;
+		const auto temp = boost::filesystem::unique_path(file + ".%%%%-%%%%-%%%%.tmp", ec).string();
+		if(ec) return;
+		try {
+			const auto lock_file = file + ".lock";
+			std::ofstream(lock_file, std::ios::app);
+			file_lock l(lock_file.c_str());
+			scoped_lock<file_lock> lock(l);
+			api<R>::import_wisdom(file.c_str());
+			if(!api<R>::export_wisdom(temp.c_str())) ec = make_error_code(boost::system::errc::io_error);
+			if(!ec) boost::filesystem::rename(temp, file, ec);
+			if(ec) boost::filesystem::remove(temp, ec);
+		} catch(const interprocess_exception &) {}
+	}
+
+	public:
+	// threads a plan can use, 1 without the FFTW threads library.
+	static int threads(int nthreads) {
+#if HAVE_FFTW_THREADS
+		return std::max(nthreads, 1);
+#else
+		return 1;
+#endif
+	}
+
+	// the plan for key, made on scratch arrays of the given size and alignment.
+	template<class R>
+	static typename api<R>::plan_ptr get(std::vector<long> key,
+		size_t in_bytes, size_t out_bytes, size_t in_align, size_t out_align, int nthreads,
+		const std::function<typename api<R>::plan_t(void *, void *)> &make) {
+		typedef typename api<R>::plan_ptr plan_ptr;
+		key.insert(key.begin(), sizeof(R));
+		auto &r = instance();
+		std::lock_guard<std::mutex> lock(r.mutex);
+#if HAVE_FFTW_THREADS
+		// before any other FFTW call of this precision, wisdom included.
+		static const bool init = api<R>::init_threads();
+#endif
+		auto i = r.plans.find(key);
+		if(i != r.plans.end()) return std::static_pointer_cast<typename plan_ptr::element_type>(i->second);
+		r.load_wisdom<R>();
+		const size_t pad = 64;
+		void *in = api<R>::malloc(in_bytes + pad), *out = api<R>::malloc(out_bytes + pad);
+#if HAVE_FFTW_THREADS
+		if(init) api<R>::plan_with_nthreads(nthreads);
+#endif
+		auto p = make(static_cast<char *>(in) + in_align, static_cast<char *>(out) + out_align);
+#if HAVE_FFTW_THREADS
+		if(init) api<R>::plan_with_nthreads(1);
+#endif
+		api<R>::free(in);
+		api<R>::free(out);
+		if(p == NULL) throw std::runtime_error("FFTW planning failed");
+		const auto file = wisdom_file<R>();
+		if(!file.empty()) r.unsaved[file] = &registry::save_wisdom<R>;
+		plan_ptr ptr(p, api<R>::destroy_plan);
+		r.plans[key] = ptr;
+		return ptr;
+	}
+};
+
+// smallest size of at least n with no prime factors above 7, fast for FFTW.
+inline size_t good_size(size_t n) {
+	for(n = std::max<size_t>(n, 1) ;; n++) {
+		size_t m = n;
+		for(size_t f : {2, 3, 5, 7})
+			while(m % f == 0) m /= f;
+		if(m == 1) return n;
+	}
+}
 
 template<size_t dims>
 struct size_a {
@@ -31,119 +233,252 @@ struct size_a {
 	}
 };
 
-// Data as fftw-compatible pointers.
+// Data as fftw-compatible pointers, works for multi_array and views of it.
 template<class T, size_t dims>
-typename fftw_map<T>::type *data(boost::multi_array<T, dims> &in) {
+typename fftw_map<T>::type *data(boost::multi_array_ref<T, dims> &in) {
 	return reinterpret_cast<typename fftw_map<T>::type *>(in.data());
 }
 
 template<class T, size_t dims>
-typename fftw_map<T>::type *data(const boost::multi_array<T, dims> &in) {
+typename fftw_map<T>::type *data(const boost::multi_array_ref<T, dims> &in) {
 	typedef typename fftw_map<T>::type U;
 	return const_cast<U *>(reinterpret_cast<const U*>(in.data()));
 }
 
-#define common()\
-	typedef boost::multi_array<T0, dims> A0; \
-	typedef boost::multi_array<T1, dims> A1; \
-	typedef plan<T0, T1, dims> this_t; \
-	fftwf_plan p; \
-	plan() : p(NULL) {} \
-	plan(this_t &other) : p(other.p) { other.p = NULL; } \
-	plan(this_t &&other) : p(other.p) { other.p = NULL; } \
-	this_t &operator=(this_t &other) { p = other.p; other.p = NULL; return *this; } \
-	this_t &operator=(this_t &&other) { p = other.p; other.p = NULL; return *this; } \
-	~plan() { \
-		if(p != NULL) \
-			fftwf_destroy_plan(p); \
+/**
+ * A transform from the registry: the plan for aligned arrays is looked up
+ * once, plans for other alignments when they are used. With nthreads > 1
+ * each transform runs on that many threads.
+ */
+template<class R>
+struct shared_plan {
+	typedef api<R> X;
+	typedef typename X::complex_t C;
+	enum kind_t { r2r_forward, r2r_inverse, r2c, c2r, c2c_forward, c2c_inverse, r2c_in_place, c2r_in_place };
+
+	kind_t kind;
+	std::vector<int> n;
+	int howmany;
+	unsigned int flags;
+	int nthreads;
+	typename X::plan_ptr p;
+
+	shared_plan() : howmany(0), flags(0), nthreads(1) {}
+
+	template<class I>
+	shared_plan(kind_t kind, I begin, I end, size_t howmany, unsigned int flags, int nthreads)
+	: kind(kind), n(begin, end), howmany(howmany), flags(flags | level_flags(config().level)),
+	  nthreads(registry::threads(nthreads)), p(get(0, 0)) {}
+
+	// plan for arrays with this alignment.
+	typename X::plan_t operator()(R *in, R *out) const {
+		const size_t a = X::alignment_of(in), b = X::alignment_of(out);
+		if(a == 0 && b == 0) return p.get();
+		// keeps the plan alive as long as the registry.
+		return get(a, b).get();
+	}
+
+	private:
+	typename X::plan_ptr get(size_t in_align, size_t out_align) const {
+		std::vector<long> key{kind, howmany, flags, nthreads, long(in_align), long(out_align)};
+		key.insert(key.end(), n.begin(), n.end());
+		size_t real = howmany, complex = howmany;
+		for(size_t i = 0 ; i < n.size() ; i++) {
+			real *= n[i];
+			complex *= i + 1 < n.size() ? n[i] : n[i] / 2 + 1;
+		}
+		const size_t r = real * sizeof(R), c = complex * sizeof(C);
+		const bool in_place = kind == r2c_in_place || kind == c2r_in_place;
+		const size_t in_bytes = kind == r2c || kind == r2r_forward || kind == r2r_inverse ? r : c;
+		const size_t out_bytes = in_place ? 0 : kind == c2r || kind == r2r_forward || kind == r2r_inverse ? r : c;
+		const int rank = n.size(), *dims = n.data(), n_r = real / howmany, n_c = complex / howmany, hm = howmany;
+		// in place, the real rows are padded to the complex ones.
+		std::vector<int> padded(n);
+		padded.back() = 2 * (n.back() / 2 + 1);
+		const int n_p = 2 * n_c;
+		const unsigned int f = flags;
+		const kind_t k = kind;
+		return registry::get<R>(key, in_bytes, out_bytes, in_align, out_align, nthreads, [=](void *in, void *out) {
+			auto r_in = static_cast<R *>(in), r_out = static_cast<R *>(out);
+			auto c_in = static_cast<C *>(in), c_out = static_cast<C *>(out);
+			switch(k) {
+			case r2c:
+				return X::plan_many_dft_r2c(rank, dims, hm, r_in, nullptr, 1, n_r, c_out, nullptr, 1, n_c, f);
+			case c2r:
+				return X::plan_many_dft_c2r(rank, dims, hm, c_in, nullptr, 1, n_c, r_out, nullptr, 1, n_r, f);
+			case r2c_in_place:
+				return X::plan_many_dft_r2c(rank, dims, hm, r_in, padded.data(), 1, n_p, c_in, nullptr, 1, n_c, f);
+			case c2r_in_place:
+				return X::plan_many_dft_c2r(rank, dims, hm, c_in, nullptr, 1, n_c, r_in, padded.data(), 1, n_p, f);
+			case c2c_forward: case c2c_inverse:
+				return X::plan_many_dft(rank, dims, hm, c_in, nullptr, 1, n_r, c_out, nullptr, 1, n_r,
+					k == c2c_forward ? FFTW_FORWARD : FFTW_BACKWARD, f);
+			default: {
+				std::vector<typename X::r2r_kind_t> kinds(rank, k == r2r_forward ? FFTW_REDFT10 : FFTW_REDFT01);
+				return X::plan_many_r2r(rank, dims, hm, r_in, nullptr, 1, n_r, r_out, nullptr, 1, n_r, kinds.data(), f);
+			}
+			}
+		});
 	}
+};
+
+// R0, R1 accept any array of that shape.
+#define common(rank)\
+	typedef boost::multi_array_ref<T0, rank> R0; \
+	typedef boost::multi_array_ref<T1, rank> R1; \
+	typedef shared_plan<R> S; \
+	S p;
 
+// Transforms in float, double or long double precision R.
 template<class T0, class T1, size_t dims>
 struct plan {};
 
-template<size_t dims>
-struct plan<float, float, dims> {
-	typedef float T0;
-	typedef float T1;
-	common()
+template<class R, size_t dims>
+struct plan<R, R, dims> {
+	typedef R T0;
+	typedef R T1;
+	common(dims)
+
+	plan() {}
 
 	template<class I>
-	plan(I size, dir_t dir = forward, unsigned int flags = 0) {
+	plan(I size, dir_t dir = forward, unsigned int flags = 0, int nthreads = 1) {
 		size_a<dims> sz(size);
-		A0 in(sz.d);
-		A1 out(sz.d);
-		fftw_r2r_kind kind[dims];
-		for(size_t i = 0 ; i < dims ; i++)
-			kind[i] = dir == forward ? FFTW_REDFT10 : FFTW_REDFT01;
-		#pragma omp critical
-		p = fftwf_plan_r2r(dims, sz, data(in), data(out), kind, flags);
+		p = S(dir == forward ? S::r2r_forward : S::r2r_inverse,
+			sz.d.begin(), sz.d.end(), 1, flags, nthreads);
 	}
 
-	void operator()(const A0 &in, A1 &out) {
-		fftwf_execute_r2r(p, data(in), data(out));
+	void operator()(const R0 &in, R1 &out) {
+		api<R>::execute_r2r(p(data(in), data(out)), data(in), data(out));
 	}
 };
 
-template<size_t dims>
-struct plan<float, std::complex<float>, dims> {
-	typedef float T0;
-	typedef std::complex<float> T1;
-	common()
+template<class R, size_t dims>
+struct plan<R, std::complex<R>, dims> {
+	typedef R T0;
+	typedef std::complex<R> T1;
+	common(dims)
+
+	plan() {}
 
 	template<class I>
-	plan(I size, unsigned int flags = 0) {
+	plan(I size, unsigned int flags = 0, int nthreads = 1) {
 		size_a<dims> sz(size);
-		A0 in(sz.d);
-		A1 out(sz.fft);
-		#pragma omp critical
-		p = fftwf_plan_dft_r2c(dims, sz, data(in), data(out), flags);
+		p = S(S::r2c, sz.d.begin(), sz.d.end(), 1, flags, nthreads);
 	}
 
-	void operator()(const A0 &in, A1 &out) {
-		fftwf_execute_dft_r2c(p, data(in), data(out));
+	void operator()(const R0 &in, R1 &out) {
+		api<R>::execute_dft_r2c(p(data(in), data(out)[0]), data(in), data(out));
 	}
 };
 
-template<size_t dims>
-struct plan<std::complex<float>, std::complex<float>, dims> {
-	typedef std::complex<float> T0;
-	typedef std::complex<float> T1;
-	common()
+template<class R, size_t dims>
+struct plan<std::complex<R>, std::complex<R>, dims> {
+	typedef std::complex<R> T0;
+	typedef std::complex<R> T1;
+	common(dims)
+
+	plan() {}
 
 	template<class I>
-	plan(I size, dir_t dir = forward, unsigned int flags = 0) {
+	plan(I size, dir_t dir = forward, unsigned int flags = 0, int nthreads = 1) {
 		size_a<dims> sz(size);
-		A0 in(sz.d);
-		A1 out(sz.d);
-		p = fftwf_plan_dft(dims, sz, data(in), data(out),
-			dir == forward ? FFTW_FORWARD : FFTW_BACKWARD, flags);
+		p = S(dir == forward ? S::c2c_forward : S::c2c_inverse,
+			sz.d.begin(), sz.d.end(), 1, flags, nthreads);
 	}
 
-	void operator()(const A0 &in, A1 &out) {
-		fftwf_execute_dft(p, data(in), data(out));
+	void operator()(const R0 &in, R1 &out) {
+		api<R>::execute_dft(p(data(in)[0], data(out)[0]), data(in), data(out));
 	}
 };
 
-template<size_t dims>
-struct plan<std::complex<float>, float, dims> {
-	typedef std::complex<float> T0;
-	typedef float T1;
-	common()
+template<class R, size_t dims>
+struct plan<std::complex<R>, R, dims> {
+	typedef std::complex<R> T0;
+	typedef R T1;
+	common(dims)
+
+	plan() {}
+
+	template<class I>
+	plan(I size, unsigned int flags = 0, int nthreads = 1) {
+		size_a<dims> sz(size);
+		p = S(S::c2r, sz.d.begin(), sz.d.end(), 1, flags, nthreads);
+	}
+
+	void operator()(const R0 &in, R1 &out) {
+		api<R>::execute_dft_c2r(p(data(in)[0], data(out)), data(in), data(out));
+	}
+};
+
+
+// Batches of transforms, the first dimension of the arrays is the batch.
+template<class T0, class T1, size_t dims>
+struct plan_many {};
+
+template<class R, size_t dims>
+struct plan_many<R, std::complex<R>, dims> {
+	typedef R T0;
+	typedef std::complex<R> T1;
+	common(dims + 1)
+
+	template<class I>
+	plan_many(I size, size_t howmany, unsigned int flags = 0, int nthreads = 1) {
+		size_a<dims> sz(size);
+		p = S(S::r2c, sz.d.begin(), sz.d.end(), howmany, flags, nthreads);
+	}
+
+	void operator()(const R0 &in, R1 &out) {
+		api<R>::execute_dft_r2c(p(data(in), data(out)[0]), data(in), data(out));
+	}
+};
+
+template<class R, size_t dims>
+struct plan_many<std::complex<R>, R, dims> {
+	typedef std::complex<R> T0;
+	typedef R T1;
+	common(dims + 1)
+
+	template<class I>
+	plan_many(I size, size_t howmany, unsigned int flags = 0, int nthreads = 1) {
+		size_a<dims> sz(size);
+		p = S(S::c2r, sz.d.begin(), sz.d.end(), howmany, flags, nthreads);
+	}
+
+	void operator()(const R0 &in, R1 &out) {
+		api<R>::execute_dft_c2r(p(data(in)[0], data(out)), data(in), data(out));
+	}
+};
+
+/**
+ * Batches of real transforms in place on complex arrays: the real data has
+ * rows padded to 2 (n/2 + 1) values, and the spectrum replaces it (forward)
+ * or is replaced by it (inverse).
+ */
+template<class R, size_t dims, dir_t dir>
+struct plan_in_place {
+	typedef shared_plan<R> S;
+	typedef typename api<R>::complex_t C;
+	S p;
+
+	plan_in_place() {}
 
 	template<class I>
-	plan(I size, unsigned int flags = 0) {
+	plan_in_place(I size, size_t howmany, unsigned int flags = 0, int nthreads = 1) {
 		size_a<dims> sz(size);
-		A0 in(sz.fft);
-		A1 out(sz.d);
-		#pragma omp critical
-		p = fftwf_plan_dft_c2r(dims, sz, data(in), data(out), flags);
+		p = S(dir == forward ? S::r2c_in_place : S::c2r_in_place,
+			sz.d.begin(), sz.d.end(), howmany, flags, nthreads);
 	}
 
-	void operator()(const A0 &in, A1 &out) {
-		fftwf_execute_dft_c2r(p, data(in), data(out));
+	void operator()(std::complex<R> *data) {
+		auto r = reinterpret_cast<R *>(data);
+		auto c = reinterpret_cast<C *>(data);
+		if(dir == forward) api<R>::execute_dft_r2c(p(r, r), r, c);
+		else api<R>::execute_dft_c2r(p(r, r), c, r);
 	}
 };
 
+#undef common
 
 }
 #endif
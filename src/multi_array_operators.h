@@ -116,6 +116,7 @@ void kernel_pad(const boost::multi_array<T1, 2> &in, boost::multi_array<T2, 2> &
 namespace std {
 	inline double conj(const double &x) { return x; }
 	inline float conj(const float &x) { return x; }
+	inline long double conj(const long double &x) { return x; }
 };
 
 
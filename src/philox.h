@@ -0,0 +1,148 @@
+#ifndef __PHILOX_H__
+#define __PHILOX_H__
+
+#include <array>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+/**
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1,
+ * 2, 3", 2011): 128 random bits as a function of a 128 bit counter and a
+ * 64 bit key. There is no state, so any part of a stream can be drawn by
+ * any thread and gives the same numbers.
+ */
+struct philox4x32 {
+	typedef std::array<uint32_t, 4> counter;
+	typedef std::array<uint32_t, 2> key;
+
+	static counter bits(counter c, key k) {
+		for(int r = 0 ; r < 10 ; r++) {
+			if(r > 0) {
+				k[0] += 0x9E3779B9;
+				k[1] += 0xBB67AE85;
+			}
+			const uint64_t p0 = uint64_t(0xD2511F53) * c[0], p1 = uint64_t(0xCD9E8D57) * c[2];
+			c = {{uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1),
+				uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0)}};
+		}
+		return c;
+	}
+};
+
+/**
+ * ln x for normal x > 0 in a few ulp, without branches or library calls
+ * so loops over it vectorize: x = 2^e m with m in [sqrt(1/2), sqrt(2)),
+ * ln m = 2 atanh(s), s = (m - 1) / (m + 1), |s| < 0.172, by its series.
+ */
+inline double box_muller_log(double x) {
+	uint64_t b;
+	std::memcpy(&b, &x, sizeof b);
+	// biased exponent of x sqrt(2), m = x 2^-e.
+	const uint64_t k = (b + (0x3FF0000000000000 - 0x3FE6A09E667F3BCD)) >> 52;
+	b -= (k - 1023) << 52;
+	double m, e;
+	std::memcpy(&m, &b, sizeof m);
+	// k as a double: its bits in the mantissa of 2^52.
+	b = 0x4330000000000000 | k;
+	std::memcpy(&e, &b, sizeof e);
+	e -= 4503599627370496.0 + 1023;
+	const double s = (m - 1) / (m + 1), z = s * s;
+	const double sum = 1 + z * (1.0 / 3 + z * (1.0 / 5 + z * (1.0 / 7 + z * (1.0 / 9 + z * (1.0 / 11
+		+ z * (1.0 / 13 + z * (1.0 / 15 + z * (1.0 / 17 + z * (1.0 / 19 + z * (1.0 / 21
+		+ z * (1.0 / 23)))))))))));
+	return e * 0.69314718055994530942 + 2 * s * sum;
+}
+
+template<class W>
+W box_muller_log(W x) {
+	return std::log(x);
+}
+
+/**
+ * Nearest integer to 4 t, for the quarter turn nearest to t turns, and
+ * the sine and cosine of x for |x| <= pi / 4, by their Taylor series, all
+ * without branches or library calls, to a few ulp.
+ */
+inline double box_muller_quarter(double t) {
+	// adding 1.5 2^52 rounds to an integer.
+	const double round = 6755399441055744.0;
+	return (4 * t + round) - round;
+}
+
+inline double box_muller_sin(double x) {
+	const double x2 = x * x;
+	return x * (1 - x2 * (1.0 / 6 - x2 * (1.0 / 120 - x2 * (1.0 / 5040 - x2 * (1.0 / 362880
+		- x2 * (1.0 / 39916800 - x2 * (1.0 / 6227020800 - x2 * (1.0 / 1307674368000
+		- x2 * (1.0 / 355687428096000)))))))));
+}
+
+inline double box_muller_cos(double x) {
+	const double x2 = x * x;
+	return 1 - x2 * (1.0 / 2 - x2 * (1.0 / 24 - x2 * (1.0 / 720 - x2 * (1.0 / 40320
+		- x2 * (1.0 / 3628800 - x2 * (1.0 / 479001600 - x2 * (1.0 / 87178291200
+		- x2 * (1.0 / 20922789888000))))))));
+}
+
+template<class W>
+W box_muller_quarter(W t) {
+	return std::round(4 * t);
+}
+
+template<class W>
+W box_muller_sin(W x) {
+	return std::sin(x);
+}
+
+template<class W>
+W box_muller_cos(W x) {
+	return std::cos(x);
+}
+
+/**
+ * out[0 .. n-1] = elements of a standard normal sample, number `sample` of
+ * the stream `seed`. Element e comes from counter (e / 4, sample), by the
+ * Box-Muller transform on pairs of 32 bit uniforms, so any thread can
+ * redraw it. The transform is in double precision, or T if that is
+ * wider; in double it vectorizes, by the functions above.
+ */
+template<class T>
+void normal_fill(uint64_t seed, uint64_t sample, T *out, size_t n) {
+	typedef typename std::conditional<(sizeof(T) > sizeof(double)), T, double>::type W;
+	static const size_t chunk = 256;
+	const philox4x32::key k{{uint32_t(seed), uint32_t(seed >> 32)}};
+	const W scale = W(1) / 4294967296.0, two_pi = 4 * std::acos(W(0));
+	uint32_t u[chunk];
+	W z[chunk];
+	for(size_t first = 0 ; first < n ; first += chunk) {
+		const size_t m = std::min(chunk, n - first), blocks = (m + 3) / 4;
+		for(size_t b = 0 ; b < blocks ; b++) {
+			const uint64_t block = first / 4 + b;
+			const auto r = philox4x32::bits({{uint32_t(block), uint32_t(block >> 32),
+				uint32_t(sample), uint32_t(sample >> 32)}}, k);
+			std::copy(r.begin(), r.end(), u + 4 * b);
+		}
+		// uniforms in (0, 1), never 0 for the log; the unsigned values are
+		// converted as signed ones shifted by 2^31.
+		#pragma omp simd
+		for(size_t i = 0 ; i < 2 * blocks ; i++) {
+			const W u1 = (W(int32_t(u[2 * i] ^ 0x80000000u)) + W(2147483648.5)) * scale;
+			const W u2 = (W(int32_t(u[2 * i + 1] ^ 0x80000000u)) + W(2147483648.5)) * scale;
+			// the angle u2 turns is q quarter turns and x radians.
+			const W q = box_muller_quarter(u2), x = (u2 - q / 4) * two_pi;
+			const W sx = box_muller_sin(x), cx = box_muller_cos(x);
+			// rotated by j quarter turns: cos is negative for j = 1, 2, sin for 2, 3.
+			const int j = int(q) & 3;
+			const W c = j & 1 ? sx : cx, s = j & 1 ? cx : sx;
+			const W r = std::sqrt(-2 * box_muller_log(u1));
+			z[2 * i] = W(1 - ((j + 1) & 2)) * r * c;
+			z[2 * i + 1] = W(1 - (j & 2)) * r * s;
+		}
+		for(size_t e = 0 ; e < m ; e++)
+			out[first + e] = T(z[e]);
+	}
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef __Q_CACHE_H__
+#define __Q_CACHE_H__
+
+#include "quantile.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+/**
+ * Simulated tails of q on disk, shared by the processes of a host. One
+ * binary file for each key, named by a stable hash of it: a header, the
+ * key, and the kept values in ascending order at an aligned offset, so
+ * they can be read from a mapping. Files are written under a temporary
+ * name and renamed over the old one, so readers never see half of one.
+ * Above the size limit, the least recently used files are removed, with
+ * the lock files no process holds.
+ */
+struct q_cache {
+	static const uint32_t version = 1;
+
+	struct header {
+		char magic[8];
+		uint32_t version, value_size;
+		uint64_t count, kept, key_size;
+	};
+
+	boost::filesystem::path dir;
+	// bytes above which the least recently used files are removed, 0 for no limit.
+	uintmax_t limit;
+
+	q_cache(const boost::filesystem::path &dir, uintmax_t limit = 0)
+	: dir(dir), limit(limit) {}
+
+	// FNV-1a, the same in every build.
+	static uint64_t hash(const std::string &key) {
+		uint64_t h = 0xcbf29ce484222325;
+		for(unsigned char c : key) {
+			h ^= c;
+			h *= 0x100000001b3;
+		}
+		return h;
+	}
+
+	boost::filesystem::path file(const std::string &key) const {
+		std::ostringstream name;
+		name << std::hex << std::setw(16) << std::setfill('0') << hash(key) << ".q";
+		return dir / name.str();
+	}
+
+	boost::filesystem::path lock_file(const std::string &key) const {
+		auto path = file(key);
+		path.replace_extension(".lock");
+		return path;
+	}
+
+	// a tail in the mapping of its file, valid as long as the view.
+	template<class T>
+	struct view {
+		boost::interprocess::mapped_region region;
+		sorted_tail<T> tail;
+	};
+
+	// maps the tail of key into out, if it is there and valid; marks it as used.
+	template<class T>
+	bool load(const std::string &key, view<T> &out) const {
+		using namespace boost::interprocess;
+		boost::system::error_code ec;
+		const auto f = file(key);
+		if(!boost::filesystem::exists(f, ec)) return false;
+		try {
+			file_mapping m(f.string().c_str(), read_only);
+			mapped_region r(m, read_only);
+			const char *data = static_cast<const char *>(r.get_address());
+			header h;
+			if(r.get_size() < sizeof h) return false;
+			std::memcpy(&h, data, sizeof h);
+			const size_t offset = values_offset(key.size());
+			if(std::memcmp(h.magic, magic(), sizeof h.magic) != 0 || h.version != version
+				|| h.value_size != sizeof(T) || h.key_size != key.size()
+				|| r.get_size() < offset + h.kept * sizeof(T)
+				|| key.compare(0, key.size(), data + sizeof h, h.key_size) != 0)
+				return false;
+			out.tail = sorted_tail<T>(reinterpret_cast<const T *>(data + offset), h.kept, h.count);
+			out.region.swap(r);
+		} catch(const interprocess_exception &) {
+			return false;
+		}
+		boost::filesystem::last_write_time(f, std::time(nullptr), ec);
+		return true;
+	}
+
+	// replaces the tail of key. The cache is best effort, failures leave it as it was.
+	template<class T>
+	void store(const std::string &key, const top_k<T> &tail) const {
+		using namespace boost::filesystem;
+		boost::system::error_code ec;
+		create_directories(dir, ec);
+		const auto target = file(key);
+		const auto tmp = dir / unique_path(target.filename().string() + ".%%%%-%%%%-%%%%.tmp", ec);
+		if(ec) return;
+		const auto values = tail.sorted();
+		header h;
+		std::memcpy(h.magic, magic(), sizeof h.magic);
+		h.version = version;
+		h.value_size = sizeof(T);
+		h.count = tail.count;
+		h.kept = values.size();
+		h.key_size = key.size();
+		{
+			std::ofstream f(tmp.string(), std::ios::binary);
+			const std::vector<char> padding(values_offset(key.size()) - sizeof h - key.size(), 0);
+			f.write(reinterpret_cast<const char *>(&h), sizeof h);
+			f.write(key.data(), key.size());
+			f.write(padding.data(), padding.size());
+			f.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+			if(!f.flush()) ec = make_error_code(boost::system::errc::io_error);
+		}
+		if(!ec) rename(tmp, target, ec);
+		if(ec) {
+			remove(tmp, ec);
+			return;
+		}
+		evict(target);
+	}
+
+	/**
+	 * Exclusive advisory lock of a key between processes, held while one
+	 * of them simulates it. Without a lock file, e.g. in a read-only
+	 * directory, it doesn't lock.
+	 */
+	struct key_lock {
+		key_lock(const q_cache &c, const std::string &key) {
+			boost::system::error_code ec;
+			boost::filesystem::create_directories(c.dir, ec);
+			const auto path = c.lock_file(key);
+			std::ofstream(path.string(), std::ios::app);
+			try {
+				boost::interprocess::file_lock l(path.string().c_str());
+				l.lock();
+				lock.swap(l);
+			} catch(const boost::interprocess::interprocess_exception &) {}
+		}
+
+		~key_lock() {
+			try {
+				lock.unlock();
+			} catch(const boost::interprocess::interprocess_exception &) {}
+		}
+
+		boost::interprocess::file_lock lock;
+	};
+
+	private:
+	static const char *magic() {
+		return "SMRE q\0\0";
+	}
+
+	// values after the header and the key, aligned for any T.
+	static size_t values_offset(size_t key_size) {
+		return (sizeof(header) + key_size + 15) / 16 * 16;
+	}
+
+	// removes the least recently used files other than keep, until the
+	// cache is within the limit, then the lock files left without a file.
+	void evict(const boost::filesystem::path &keep) const {
+		using namespace boost::filesystem;
+		if(limit == 0) return;
+		struct entry {
+			std::time_t used;
+			uintmax_t size;
+			path file;
+		};
+		std::vector<entry> entries;
+		std::vector<path> locks;
+		uintmax_t total = 0;
+		boost::system::error_code ec;
+		for(directory_iterator i(dir, ec), end ; !ec && i != end ; i.increment(ec)) {
+			if(i->path().extension() == ".lock") locks.push_back(i->path());
+			if(i->path().extension() != ".q") continue;
+			boost::system::error_code used_ec, size_ec;
+			const entry e{last_write_time(i->path(), used_ec), file_size(i->path(), size_ec), i->path()};
+			if(used_ec || size_ec) continue;
+			total += e.size;
+			if(e.file != keep) entries.push_back(e);
+		}
+		std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+			return a.used < b.used;
+		});
+		for(auto &e : entries) {
+			if(total <= limit) break;
+			// others may have removed it, or still read their mapping of it.
+			remove(e.file, ec);
+			total -= e.size;
+		}
+		for(const auto &l : locks) {
+			auto f = l;
+			if(!exists(f.replace_extension(".q"), ec)) remove_lock(l);
+		}
+	}
+
+	// removes a lock file unless a process holds it. One that opened it
+	// but didn't lock it yet may lock the removed file, which only costs
+	// a simulation twice.
+	static void remove_lock(const boost::filesystem::path &f) {
+		using namespace boost::interprocess;
+		try {
+			file_lock l(f.string().c_str());
+			if(!l.try_lock()) return;
+			boost::system::error_code ec;
+			boost::filesystem::remove(f, ec);
+			l.unlock();
+		} catch(const interprocess_exception &) {}
+	}
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef __QUANTILE_H__
+#define __QUANTILE_H__
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <cmath>
+
+/**
+ * The kept largest of count values in ascending order, held elsewhere: by
+ * top_k::sorted() or by a mapped cache file.
+ */
+template<class T>
+struct sorted_tail {
+	const T *values;
+	size_t kept, count;
+
+	sorted_tail(const T *values = nullptr, size_t kept = 0, size_t count = 0)
+	: values(values), kept(kept), count(count) {}
+
+	// whether the p quantile is among the kept values.
+	bool has(double p) const {
+		return count > 0 && count - index(p, count) <= kept;
+	}
+
+	// whether value r of all in ascending order is kept.
+	bool holds(size_t r) const {
+		return r < count && count - r <= kept;
+	}
+
+	// value r of all in ascending order, if held.
+	T at(size_t r) const {
+		return values[kept - (count - r)];
+	}
+
+	// the p quantile, value (count - 1) p of all in ascending order.
+	T quantile(double p) const {
+		if(!has(p)) throw std::out_of_range("quantile below the kept values");
+		return at(index(p, count));
+	}
+
+	static size_t index(double p, size_t n) {
+		return size_t((n - 1) * p);
+	}
+};
+
+/**
+ * The k largest of all values pushed, and how many there were, for exact
+ * upper quantiles in memory bounded by k. Workers keep their own and
+ * merge them when they are done.
+ */
+template<class T>
+struct top_k {
+	size_t k, count;
+
+	explicit top_k(size_t k = 0) : k(k), count(0) {
+		heap.reserve(k);
+	}
+
+	void push(T x) {
+		count++;
+		keep(x);
+	}
+
+	void merge(const top_k &o) {
+		count += o.count;
+		for(auto x : o.heap) keep(x);
+	}
+
+	// the kept values in ascending order.
+	std::vector<T> sorted() const {
+		std::vector<T> v(heap);
+		std::sort(v.begin(), v.end());
+		return v;
+	}
+
+	// whether the p quantile is among the kept values.
+	bool has(double p) const {
+		return sorted_tail<T>(nullptr, heap.size(), count).has(p);
+	}
+
+	// the p quantile, value (count - 1) p of all in ascending order.
+	T quantile(double p) const {
+		const auto v = sorted();
+		return sorted_tail<T>(v.data(), v.size(), count).quantile(p);
+	}
+
+	// values needed for the p quantile of n.
+	static size_t needed(double p, size_t n) {
+		return n ? n - sorted_tail<T>::index(p, n) : 0;
+	}
+
+	/**
+	 * lo, hi: ranks in ascending order of n values whose interval contains
+	 * the p quantile with at least the given confidence, whatever the
+	 * distribution of the values: the count of values below the quantile
+	 * is binomial(n, p), its tails beyond the ranks are summed exactly.
+	 * False if the interval reaches out of the values.
+	 */
+	static bool interval(double p, size_t n, size_t &lo, size_t &hi, double confidence = 0.95) {
+		lo = hi = 0;
+		if(n == 0 || p <= 0 || p >= 1) return false;
+		const double tail = (1 - confidence) / 2;
+		// the probabilities of the counts around the mean, below 1e-300
+		// outside of 40 standard deviations.
+		const size_t mode = std::min(n, size_t((n + 1) * p));
+		const size_t w = size_t(40 * std::sqrt(n * p * (1 - p))) + 40;
+		const size_t first = mode > w ? mode - w : 0, last = std::min(n, mode + w);
+		std::vector<double> f(last - first + 1);
+		const double log_p = std::log(p), log_q = std::log1p(-p), log_n = std::lgamma(n + 1.0);
+		for(size_t c = first ; c <= last ; c++)
+			f[c - first] = std::exp(log_n - std::lgamma(c + 1.0) - std::lgamma(n - c + 1.0)
+				+ c * log_p + (n - c) * log_q);
+		// lo: the highest count c with P(count <= c) <= tail, value c is
+		// above the quantile with at most that probability.
+		bool has_lo = first > 0;
+		lo = has_lo ? first - 1 : 0;
+		double below = 0;
+		for(size_t c = first ; c <= last ; c++) {
+			below += f[c - first];
+			if(below > tail) break;
+			lo = c;
+			has_lo = true;
+		}
+		// hi + 1: the lowest count c with P(count >= c) <= tail, value hi
+		// is below the quantile with at most that probability.
+		size_t u = last + 1;
+		double above = 0;
+		for(size_t c = last + 1 ; c-- > first ; ) {
+			above += f[c - first];
+			if(above > tail) break;
+			u = c;
+		}
+		if(!has_lo || u > n) {
+			lo = 0;
+			return false;
+		}
+		hi = u - 1;
+		return true;
+	}
+
+	private:
+	// min-heap of the largest values.
+	std::vector<T> heap;
+
+	void keep(T x) {
+		if(heap.size() < k) {
+			heap.push_back(x);
+			std::push_heap(heap.begin(), heap.end(), std::greater<T>());
+		} else if(k > 0 && x > heap.front()) {
+			std::pop_heap(heap.begin(), heap.end(), std::greater<T>());
+			heap.back() = x;
+			std::push_heap(heap.begin(), heap.end(), std::greater<T>());
+		}
+	}
+};
+
+#endif
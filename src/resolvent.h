@@ -53,13 +53,16 @@ struct resolvent_params {
  * resolvent class, have to implement the evaluation of the resolvent.
  */
 template<class T>
-struct resolvent_l2_cpu : public resolvent_cpu<T> {
+struct resolvent_l2_cpu final : public resolvent_cpu<T> {
 	resolvent_l2_cpu() : resolvent_cpu<T>(1) {}
 
 	virtual void evaluate(T tau, const boost::multi_array<T, 2> &in, boost::multi_array<T, 2> &out) {
-		using namespace mimas;
-		out = in;
-		out /= 1 + tau;
+		const T d = 1 + tau;
+		const T *i = in.data();
+		T *o = out.data();
+		#pragma omp simd
+		for(size_t n = 0 ; n < out.num_elements() ; n++)
+			o[n] = i[n] / d;
 	}
 };
 
@@ -85,6 +88,12 @@ struct resolvent_l2_params : public resolvent_params<T> {
 	}
 };
 
+// OpenCL has no long double.
+template<>
+inline std::shared_ptr<resolvent_gpu<long double>> resolvent_l2_params<long double>::gpu_runner(size2_t) const {
+	throw std::invalid_argument("no long double on the GPU");
+}
+
 /**
  * given \f$\alpha>0\f$ and \f$ y \in \Omega = \mathbb R^I\f$ solve
  *
@@ -130,9 +139,10 @@ struct helmholtz_cpu {
 	: laplace_dct(laplacian<T>(size)), temp(size),
 	  dct(size, fftw::forward), idct(size, fftw::inverse) {}
 
-	void solve(const T alpha, const boost::multi_array<T, 2> &in, boost::multi_array<T, 2> &out) {
+	// solves for factor * in, the factor is applied to the spectrum.
+	void solve(const T alpha, const boost::multi_array<T, 2> &in, boost::multi_array<T, 2> &out, T factor = 1) {
 		const size_t m = temp.shape()[0], n = temp.shape()[1];
-		const T scale = 1.0 / (4 * m * n);
+		const T scale = factor / (4 * m * n);
 		dct(in, temp);
 		for(size_t i = 0 ; i < m ; i++)
 			for(size_t j = 0 ; j < n ; j++)
@@ -202,18 +212,15 @@ struct resolvent_h1_params : public resolvent_params<T> {
 };
 
 template<class T>
-struct resolvent_h1_cpu : public resolvent_cpu<T> {
+struct resolvent_h1_cpu final : public resolvent_cpu<T> {
 	const resolvent_h1_params<T> p;
 	helmholtz_cpu<T> h;
 	resolvent_h1_cpu(resolvent_h1_params<T> p, size2_t size)
 	: resolvent_cpu<T>(1 - p.delta), p(p), h(size) {}
 
 	virtual void evaluate(T tau, const boost::multi_array<T, 2> &in, boost::multi_array<T, 2> &out) {
-		using namespace mimas;
 		const T alpha = (1 + tau * (1 - p.delta)) / (tau * p.delta);
-		out = in;
-		out *= 1 / (-tau * p.delta);
-		h.solve(alpha, out, out);
+		h.solve(alpha, in, out, 1 / (-tau * p.delta));
 	}
 };
 
@@ -241,6 +248,11 @@ std::shared_ptr<resolvent_gpu<T>> resolvent_h1_params<T>::gpu_runner(size2_t siz
 	return std::make_shared<resolvent_h1_gpu<T>>(*this, size);
 }
 
+template<>
+inline std::shared_ptr<resolvent_gpu<long double>> resolvent_h1_params<long double>::gpu_runner(size2_t) const {
+	throw std::invalid_argument("no long double on the GPU");
+}
+
 
 
 
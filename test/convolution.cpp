@@ -1,8 +1,10 @@
 #include "multi_array_fft.h"
 #include "multi_array_operators.h"
 #include <iostream>
+#include <limits>
 #include "multi_array_io.h"
 #include "convolution.h"
+#include "hybrid_convolver.h"
 
 using namespace std;
 using namespace boost;
@@ -10,6 +12,10 @@ using namespace boost;
 typedef float T;
 typedef multi_array<T, 2> A;
 
+// largest difference between float convolutions of values in [-1, 1]
+// computed in different ways.
+const T tolerance = 1e-4;
+
 void dir_conv(const A &in, A &out, size_t h, bool adj) {
 	const T scale = 1 / (M_SQRT2 * h);
 	const size_t s0 = in.shape()[0], s1 = in.shape()[1];
@@ -30,7 +36,7 @@ void conv(const A &x, A &y, size_t h, bool adj) {
 	auto c = new Conv(extents_of(x));
 	auto i = c->_prepare_image(x);
 	auto k = c->prepare_kernel(h, adj);
-	c->_conv(i, k, y);
+	c->_conv(*i, *k, y);
 	delete c;
 }
 
@@ -48,12 +54,280 @@ T dot(const A &x, const A &y) {
 }
 
 template<class Conv>
-void check_adj(const A &x, const A &y, size_t h) {
+bool check_adj(const A &x, const A &y, size_t h) {
 	A kx(x), aky(x);
 	conv<Conv>(x, kx, h, false);
 	conv<Conv>(y, aky, h, true);
 	T l = dot(kx, y), r = dot(x, aky);
 	cout << l << " - " << r << "  = " << abs(l - r) << endl;
+	// the sums of products round relative to |K X| |Y|.
+	return abs(l - r) <= tolerance * sqrt(dot(kx, kx) * dot(y, y));
+}
+
+// test: conv_sum(X, Y) = K_1 * X + K_2 * Y
+template<class Conv>
+bool check_sum(const A &x, const A &y, size_t h) {
+	Conv c(extents_of(x));
+	auto k1 = c.prepare_kernel(h, true), k2 = c.prepare_kernel(h / 2, true);
+	auto ix = c.prepare_image(x), iy = c.prepare_image(y);
+	A k1x(x), k2y(x), sum(x);
+	c.conv(*ix, *k1, k1x);
+	c.conv(*iy, *k2, k2y);
+	c.conv_sum({ix, iy}, {k1, k2}, sum);
+	T err = 0;
+	for(size_t i0 = 0 ; i0 < x.shape()[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < x.shape()[1] ; i1++)
+			err = max(err, abs(k1x[i0][i1] + k2y[i0][i1] - sum[i0][i1]));
+	cout << "sum error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: conv_all(X)[j] = K_j * X, prepare_images({X, Y})
+template<class Conv>
+bool check_all(const A &x, const A &y, size_t h) {
+	Conv c(extents_of(x));
+	const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+	auto k1 = c.prepare_kernel(h, false), k2 = c.prepare_kernel(h / 2 + 1, true);
+	multi_array<T, 3> xy(extents[2][s0][s1]), all(xy);
+	xy[0] = x;
+	xy[1] = y;
+	auto ixy = c.prepare_images(xy);
+	A k1x(x), k2y(x);
+	c.conv(*c.prepare_image(x), *k1, k1x);
+	c.conv(*c.prepare_image(y), *k2, k2y);
+	c.conv_all(*ixy[0], {k1, k2}, all);
+	T err = 0;
+	for(size_t i0 = 0 ; i0 < s0 ; i0++)
+		for(size_t i1 = 0 ; i1 < s1 ; i1++)
+			err = max(err, abs(k1x[i0][i1] - all[0][i0][i1]));
+	c.conv_all(*ixy[1], {k1, k2}, all);
+	for(size_t i0 = 0 ; i0 < s0 ; i0++)
+		for(size_t i1 = 0 ; i1 < s1 ; i1++)
+			err = max(err, abs(k2y[i0][i1] - all[1][i0][i1]));
+	cout << "batch error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: on sizes with large prime factors, the padded FFT equals the direct sums
+bool check_padded(size_t h) {
+	A x(extents[37][29]), kx(x), dx(x), sum(x), dsum(x);
+	fillrandom(x);
+	cpu_fft_convolver<T> c(extents_of(x), 1, h);
+	auto i = c.prepare_image(x);
+	auto k = c.prepare_kernel(h, false), adj_k = c.prepare_kernel(h, true);
+	T err = 0;
+	c.conv(*i, *k, kx);
+	dir_conv(x, dx, h, false);
+	for(size_t i0 = 0 ; i0 < x.shape()[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < x.shape()[1] ; i1++)
+			err = max(err, abs(kx[i0][i1] - dx[i0][i1]));
+	c.conv_sum({i, i}, {k, adj_k}, sum);
+	dir_conv(x, dsum, h, true);
+	for(size_t i0 = 0 ; i0 < x.shape()[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < x.shape()[1] ; i1++)
+			err = max(err, abs(dx[i0][i1] + dsum[i0][i1] - sum[i0][i1]));
+	cout << "padded " << c.n[0] << 'x' << c.n[1] << " error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: in place, conv_all into the padded batch and conv_sum of spectra
+// kept in it match the transforms with separate arrays.
+bool check_in_place(const A &x, const A &y, size_t h) {
+	const auto s = extents_of(x);
+	cpu_fft_convolver<T> c(s, 1, 0, true), ref(s);
+	auto k = c.prepare_kernel(h, false), adj_k = c.prepare_kernel(h, true);
+	auto ref_k = ref.prepare_kernel(h, false), ref_adj_k = ref.prepare_kernel(h, true);
+	const auto b = c.batch_shape(s);
+	multi_array<T, 3> xy(extents[2][s[0]][s[1]]), all(extents[2][b[0]][b[1]]), ref_all(xy);
+	xy[0] = x;
+	xy[1] = y;
+	c.conv_all(*c.prepare_image(x), {k, adj_k}, all);
+	ref.conv_all(*ref.prepare_image(x), {ref_k, ref_adj_k}, ref_all);
+	T err = 0;
+	for(size_t j = 0 ; j < 2 ; j++)
+		for(size_t i0 = 0 ; i0 < s[0] ; i0++)
+			for(size_t i1 = 0 ; i1 < s[1] ; i1++)
+				err = max(err, abs(all[j][i0][i1] - ref_all[j][i0][i1]));
+	A sum(x), ref_sum(x);
+	cpu_convolver<T>::images ixy;
+	c.prepare_images_into(xy, all, ixy);
+	c.conv_sum(ixy, {k, adj_k}, sum);
+	ref.conv_sum(ref.prepare_images(xy), {ref_k, ref_adj_k}, ref_sum);
+	for(size_t i0 = 0 ; i0 < s[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < s[1] ; i1++)
+			err = max(err, abs(sum[i0][i1] - ref_sum[i0][i1]));
+	cout << "in place error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: in precision R, the FFT convolution matches the SAT.
+template<class R>
+bool check_precision(const A &x, size_t h) {
+	multi_array<R, 2> xr(extents_of(x)), fft(xr), sat(xr);
+	std::copy(x.data(), x.data() + x.num_elements(), xr.data());
+	cpu_fft_convolver<R> f(extents_of(x));
+	cpu_sat_convolver<R> s(extents_of(x));
+	f.conv(*f.prepare_image(xr), *f.prepare_kernel(h, false), fft);
+	s.conv(*s.prepare_image(xr), *s.prepare_kernel(h, false), sat);
+	R err = 0;
+	for(size_t i0 = 0 ; i0 < x.shape()[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < x.shape()[1] ; i1++)
+			err = max(err, abs(fft[i0][i1] - sat[i0][i1]));
+	cout << "precision " << sizeof(R) << " error " << err << endl;
+	return err <= 1e4 * std::numeric_limits<R>::epsilon();
+}
+
+// test: dual_update(X, Y) equals the default full image passes
+template<class Conv>
+bool check_dual(const A &x, const A &y, size_t h) {
+	Conv c(extents_of(x));
+	const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+	const std::vector<size_t> hs = {h, 3, 5 * h};
+	std::vector<std::shared_ptr<prepared_kernel>> ks, adj_ks;
+	for(auto h : hs) {
+		ks.push_back(c.prepare_kernel(h, false));
+		adj_ks.push_back(c.prepare_kernel(h, true));
+	}
+	multi_array<T, 3> ys(extents[hs.size()][s0][s1]), ref_ys(ys);
+	for(size_t j = 0 ; j < hs.size() ; j++) ys[j] = y;
+	ref_ys = ys;
+	auto update = [&](size_t, size_t, T *y, const T *k_x) {
+		for(size_t i1 = 0 ; i1 < s1 ; i1++) y[i1] = max(T(0), y[i1] + k_x[i1]);
+	};
+	A w(x), ref_w(x);
+	c.dual_update(x, ks, adj_ks, ys, update, w);
+	c.cpu_convolver<T>::dual_update(x, ks, adj_ks, ref_ys, update, ref_w);
+	T err = 0;
+	for(size_t i0 = 0 ; i0 < s0 ; i0++)
+		for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+			err = max(err, abs(w[i0][i1] - ref_w[i0][i1]));
+			for(size_t j = 0 ; j < hs.size() ; j++)
+				err = max(err, abs(ys[j][i0][i1] - ref_ys[j][i0][i1]));
+		}
+	cout << "dual update error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: overlap-save on 128 x 128 tiles equals the full frame FFT
+bool check_tiled(const A &x, const A &y, size_t h) {
+	cpu_tiled_fft_convolver<T> c(extents_of(x), 128);
+	cpu_fft_convolver<T> ref(extents_of(x));
+	const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+	std::vector<std::shared_ptr<prepared_kernel>> ks{c.prepare_kernel(h, false), c.prepare_kernel(h / 2 + 1, true)},
+		ref_ks{ref.prepare_kernel(h, false), ref.prepare_kernel(h / 2 + 1, true)};
+	multi_array<T, 3> all(extents[2][s0][s1]), ref_all(all);
+	c.conv_all(*c.prepare_image(x), ks, all);
+	ref.conv_all(*ref.prepare_image(x), ref_ks, ref_all);
+	A sum(x), ref_sum(x);
+	c.conv_sum({c.prepare_image(x), c.prepare_image(y)}, ks, sum);
+	ref.conv_sum({ref.prepare_image(x), ref.prepare_image(y)}, ref_ks, ref_sum);
+	T err = 0;
+	for(size_t i0 = 0 ; i0 < s0 ; i0++)
+		for(size_t i1 = 0 ; i1 < s1 ; i1++) {
+			err = max(err, abs(sum[i0][i1] - ref_sum[i0][i1]));
+			for(size_t j = 0 ; j < 2 ; j++)
+				err = max(err, abs(all[j][i0][i1] - ref_all[j][i0][i1]));
+		}
+#if HAVE_OPENMP
+	// more threads than tiles: a thread for each tile and kernel.
+	const int threads = omp_get_max_threads();
+	omp_set_num_threads(128);
+	c.conv_all(*c.prepare_image(x), ks, all);
+	omp_set_num_threads(threads);
+	for(size_t j = 0 ; j < 2 ; j++)
+		for(size_t i0 = 0 ; i0 < s0 ; i0++)
+			for(size_t i1 = 0 ; i1 < s1 ; i1++)
+				err = max(err, abs(all[j][i0][i1] - ref_all[j][i0][i1]));
+#endif
+	cout << "tiled error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: hybrid_convolver with a different convolver for each size
+bool check_hybrid(const A &x, const A &y) {
+	convolver_costs costs;
+	costs.c[convolver_costs::direct] = {0, 0, 1, 0, 0};
+	costs.c[convolver_costs::separable] = {0, 10, 0, 0, 0};
+	costs.c[convolver_costs::sat] = {0, 1, 0.5, 0, 0};
+	costs.c[convolver_costs::fft] = {0, 4.5, 0, 0, 0};
+	hybrid_convolver<T> c(extents_of(x), costs);
+	const size_t s0 = x.shape()[0], s1 = x.shape()[1];
+	const std::vector<size_t> hs = {1, 3, 20};
+	c.plan(hs);
+	std::vector<std::shared_ptr<prepared_kernel>> ks, adj_ks;
+	for(auto h : hs) {
+		ks.push_back(c.prepare_kernel(h, false));
+		adj_ks.push_back(c.prepare_kernel(h, true));
+	}
+	multi_array<T, 3> all(extents[hs.size()][s0][s1]);
+	c.conv_all(*c.prepare_image(x), ks, all);
+	A sum(x), ref(x), ref_sum(x);
+	c.conv_sum({c.prepare_image(x), c.prepare_image(y), c.prepare_image(x)}, adj_ks, sum);
+	T err = 0;
+	for(size_t j = 0 ; j < hs.size() ; j++) {
+		dir_conv(x, ref, hs[j], false);
+		for(size_t i0 = 0 ; i0 < s0 ; i0++)
+			for(size_t i1 = 0 ; i1 < s1 ; i1++)
+				err = max(err, abs(ref[i0][i1] - all[j][i0][i1]));
+		dir_conv(j == 1 ? y : x, ref, hs[j], true);
+		for(size_t i0 = 0 ; i0 < s0 ; i0++)
+			for(size_t i1 = 0 ; i1 < s1 ; i1++)
+				ref_sum[i0][i1] = (j == 0 ? 0 : ref_sum[i0][i1]) + ref[i0][i1];
+	}
+	for(size_t i0 = 0 ; i0 < s0 ; i0++)
+		for(size_t i1 = 0 ; i1 < s1 ; i1++)
+			err = max(err, abs(ref_sum[i0][i1] - sum[i0][i1]));
+	cout << "hybrid error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: conv_max_abs(X)[j] = max |K_j * X|
+template<class Conv>
+bool check_max_abs(const A &x, size_t h) {
+	Conv c(extents_of(x));
+	std::vector<std::shared_ptr<prepared_kernel>> ks;
+	for(size_t k : {size_t(1), h / 2, h, x.shape()[1]})
+		for(bool adj : {false, true})
+			ks.push_back(c.prepare_kernel(k, adj));
+	auto i = c.prepare_image(x);
+	A temp(x), kx(x);
+	std::vector<T> m;
+	c.conv_max_abs(*i, ks, temp, m);
+	T err = 0;
+	for(size_t j = 0 ; j < ks.size() ; j++) {
+		c.conv(*i, *ks[j], kx);
+		err = max(err, abs(m[j] - mimas::norm_inf(kx)));
+	}
+	cout << "max abs error " << err << endl;
+	return err <= tolerance;
+}
+
+// test: conv_sum gives the same bits with one thread as with all.
+template<class Conv>
+bool check_threads(const A &x, const A &y, size_t h) {
+#if HAVE_OPENMP
+	Conv c(extents_of(x));
+	std::vector<std::shared_ptr<prepared_kernel>> ks;
+	std::vector<std::shared_ptr<prepared_image>> is;
+	for(size_t j = 0 ; j < 7 ; j++) {
+		ks.push_back(c.prepare_kernel(h / (j + 1) + 1, true));
+		is.push_back(c.prepare_image(j % 2 ? x : y));
+	}
+	A one(x), all(x);
+	const int threads = omp_get_max_threads();
+	omp_set_num_threads(1);
+	c.conv_sum(is, ks, one);
+	omp_set_num_threads(threads);
+	c.conv_sum(is, ks, all);
+	T err = 0;
+	for(size_t i0 = 0 ; i0 < x.shape()[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < x.shape()[1] ; i1++)
+			err = max(err, abs(one[i0][i1] - all[i0][i1]));
+	cout << "thread difference " << err << endl;
+	return err == 0;
+#else
+	return true;
+#endif
 }
 
 int main(int argc, char **argv) {
@@ -71,14 +345,38 @@ int main(int argc, char **argv) {
 		conv<cpu_fft_convolver<T>>(in, out, h, adj); multi_array_to_pixbuf(out)->save("conv_cpu_fft.png", "png");
 		conv<gpu_sat_convolver<T>>(in, out, h, adj); multi_array_to_pixbuf(out)->save("conv_gpu_sat.png", "png");
 		conv<cpu_sat_convolver<T>>(in, out, h, adj); multi_array_to_pixbuf(out)->save("conv_cpu_sat.png", "png");
+		conv<cpu_separable_box_convolver<T>>(in, out, h, adj); multi_array_to_pixbuf(out)->save("conv_cpu_sep.png", "png");
 	} else { // test: dot(adj(K) * X, Y) = dot(X, K * Y)
 		A x(extents[512][512]), y(x);
 		fillrandom(x);
 		fillrandom(y);
-		check_adj<gpu_fft_convolver<T>>(x, y, h);
-		check_adj<cpu_fft_convolver<T>>(x, y, h);
-		check_adj<gpu_sat_convolver<T>>(x, y, h);
-		check_adj<cpu_sat_convolver<T>>(x, y, h);
+		bool ok = check_adj<gpu_fft_convolver<T>>(x, y, h);
+		ok &= check_adj<cpu_fft_convolver<T>>(x, y, h);
+		ok &= check_adj<gpu_sat_convolver<T>>(x, y, h);
+		ok &= check_adj<cpu_sat_convolver<T>>(x, y, h);
+		ok &= check_adj<cpu_separable_box_convolver<T>>(x, y, h);
+		ok &= check_sum<cpu_fft_convolver<T>>(x, y, h);
+		ok &= check_sum<cpu_sat_convolver<T>>(x, y, h);
+		ok &= check_sum<cpu_separable_box_convolver<T>>(x, y, h);
+		ok &= check_all<cpu_fft_convolver<T>>(x, y, h);
+		ok &= check_all<cpu_sat_convolver<T>>(x, y, h);
+		ok &= check_all<cpu_separable_box_convolver<T>>(x, y, h);
+		ok &= check_threads<cpu_sat_convolver<T>>(x, y, h);
+		ok &= check_max_abs<cpu_sat_convolver<T>>(x, h);
+		ok &= check_max_abs<cpu_sat_convolver<T, int64_t>>(x, h);
+		ok &= check_max_abs<cpu_fft_convolver<T>>(x, h);
+		ok &= check_threads<cpu_separable_box_convolver<T>>(x, y, h);
+		ok &= check_adj<cpu_direct_box_convolver<T>>(x, y, 3);
+		ok &= check_dual<cpu_sat_convolver<T, double>>(x, y, h);
+		ok &= check_tiled(x, y, h);
+		ok &= check_adj<cpu_tiled_fft_convolver<T>>(x, y, h);
+		ok &= check_hybrid(x, y);
+		ok &= check_padded(1);
+		ok &= check_padded(h);
+		ok &= check_in_place(x, y, h);
+		ok &= check_precision<double>(x, h);
+		ok &= check_precision<long double>(x, h);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
 	
@@ -33,10 +33,10 @@ void check(std::string id, std::string name, size2_t size, size_t runs, std::vec
 			in = in_;
 
 			auto i_f = c_f._prepare_image(in_);
-			c_f._conv(i_f, k_f, out_);
+			c_f._conv(*i_f, *k_f, out_);
 
 			auto i_r = c_r._prepare_image(in);
-			c_r._conv(i_r, k_r, ref);
+			c_r._conv(*i_r, *k_r, ref);
 
 			float50 total_diff(0), total_ref(0);
 			for(size_t i0 = 0 ; i0 < size[0] ; i0++ ) {
@@ -71,7 +71,7 @@ int main(int argc, char **argv) {
 	using namespace boost::program_options;
 	size_t s, runs;
 	sizes_t hs{9};
-	std::string sat_gpu_f, sat_cpu_f, fft_gpu_f, fft_cpu_f;
+	std::string sat_gpu_f, sat_cpu_f, sat_cpu_d_f, sat_cpu_x_f, fft_gpu_f, fft_cpu_f, sep_cpu_f;
 	options_description desc("Options");
 	desc.add_options()
 		("help", "show help")
@@ -79,8 +79,11 @@ int main(int argc, char **argv) {
 		("box", value(&hs)->default_value(hs), "box size")
 		("sat-gpu", value(&sat_gpu_f)->default_value("")->implicit_value("-"), "output filename")
 		("sat-cpu", value(&sat_cpu_f)->default_value("")->implicit_value("-"), "output filename")
+		("sat-cpu-double", value(&sat_cpu_d_f)->default_value("")->implicit_value("-"), "output filename")
+		("sat-cpu-fixed", value(&sat_cpu_x_f)->default_value("")->implicit_value("-"), "output filename")
 		("fft-gpu", value(&fft_gpu_f)->default_value("")->implicit_value("-"), "output filename")
 		("fft-cpu", value(&fft_cpu_f)->default_value("")->implicit_value("-"), "output filename")
+		("sep-cpu", value(&sep_cpu_f)->default_value("")->implicit_value("-"), "output filename")
 		("runs", value(&runs)->default_value(10), "number of runs to measure");
 	variables_map vm;
 	store(parse_command_line(argc, argv, desc), vm);
@@ -103,8 +106,11 @@ int main(int argc, char **argv) {
 
 	if(sat_gpu_f.size() > 0) check<gpu_sat_convolver<float>>("satgpu", sat_gpu_f, size, runs, hs);
 	if(sat_cpu_f.size() > 0) check<cpu_sat_convolver<float>>("satcpu", sat_cpu_f, size, runs, hs);
+	if(sat_cpu_d_f.size() > 0) check<cpu_sat_convolver<float, double>>("satcpud", sat_cpu_d_f, size, runs, hs);
+	if(sat_cpu_x_f.size() > 0) check<cpu_sat_convolver<float, int64_t>>("satcpux", sat_cpu_x_f, size, runs, hs);
 	if(fft_gpu_f.size() > 0) check<gpu_fft_convolver<float>>("fftgpu", fft_gpu_f, size, runs, hs);
 	if(fft_cpu_f.size() > 0) check<cpu_fft_convolver<float>>("fftcpu", fft_cpu_f, size, runs, hs);
+	if(sep_cpu_f.size() > 0) check<cpu_separable_box_convolver<float>>("sepcpu", sep_cpu_f, size, runs, hs);
 
 	return EXIT_SUCCESS;
 }
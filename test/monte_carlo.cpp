@@ -0,0 +1,177 @@
+#include "chambolle_pock.h"
+#include "philox.h"
+#include "q_cache.h"
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+typedef float T;
+typedef boost::multi_array<T, 2> A;
+
+// test: known answers of Random123.
+bool check_philox() {
+	const auto r = philox4x32::bits({{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}}, {{0xa4093822, 0x299f31d0}});
+	const bool ok = r[0] == 0xd16cfe09 && r[1] == 0x94fdcceb && r[2] == 0x5001e420 && r[3] == 0x24126ea1;
+	cout << "philox " << (ok ? "ok" : "wrong") << endl;
+	return ok;
+}
+
+// test: normal_fill has the moments and the tails of a standard normal, and an
+// element comes out the same in any window of the sample.
+bool check_normal() {
+	const size_t n = 1 << 20;
+	vector<T> z(n), part(5);
+	normal_fill(7, 3, z.data(), n);
+	normal_fill(7, 3, part.data(), part.size());
+	double mean = 0, var = 0;
+	size_t tail = 0;
+	for(T v : z) {
+		mean += v;
+		var += double(v) * v;
+		tail += abs(v) > 3;
+	}
+	mean /= n;
+	var = var / n - mean * mean;
+	const double p3 = double(tail) / n;
+	cout << "normal mean " << mean << " variance " << var << " beyond 3 " << p3 << endl;
+	return abs(mean) < 0.005 && abs(var - 1) < 0.005 && abs(p3 - 0.0027) < 0.0003
+		&& equal(part.begin(), part.end(), z.begin());
+}
+
+// q from the Monte Carlo simulation with seed on threads.
+T simulate(size_t seed, int threads) {
+#if HAVE_OPENMP
+	omp_set_num_threads(threads);
+#endif
+	params<T> p({{64, 48}}, {1, 3, 7});
+	p.no_cache = true;
+	p.monte_carlo_steps = 50;
+	p.mc_seed = seed;
+	p.max_steps = 1;
+	p.input_stddev = 1;
+	auto r = p.runner();
+	r->run(A(p.size));
+	return r->q;
+}
+
+// test: a cached q is used for as many samples as it has, or fewer, and
+// simulated again for more.
+bool check_cached_steps() {
+	namespace fs = boost::filesystem;
+	const auto dir = fs::temp_directory_path() / fs::unique_path();
+	const auto simulated = [&](size_t steps) {
+		params<T> p({{64, 48}}, {1, 3, 7});
+		p.cache_dir = dir.string();
+		p.monte_carlo_steps = steps;
+		p.mc_seed = 7;
+		p.max_steps = 1;
+		p.input_stddev = 1;
+		auto r = p.runner();
+		bool mc = false;
+		r->progress_cb = [&](double, string d) { mc |= d.find("Monte Carlo") == 0; };
+		r->run(A(p.size));
+		return mc;
+	};
+	const bool first = simulated(100), again = simulated(100), more = simulated(1000), fewer = simulated(100);
+	fs::remove_all(dir);
+	cout << "cached steps: 100 " << first << ", 100 " << again << ", 1000 " << more << ", 100 " << fewer << endl;
+	return first && !again && more && !fewer;
+}
+
+// test: the same seed gives the same q on any number of threads.
+bool check_seed() {
+	const T one = simulate(7, 1), all = simulate(7, 4), other = simulate(8, 4);
+	cout << "q " << one << " " << all << ", other seed " << other << endl;
+	return one == all && one != other;
+}
+
+// test: the merged tails give the quantiles of the full sort.
+bool check_top_k() {
+	const size_t n = 10007, parts = 7;
+	vector<T> all(n);
+	for(auto &v : all) v = T(rand()) / RAND_MAX;
+	vector<T> sorted(all);
+	sort(sorted.begin(), sorted.end());
+	bool ok = true;
+	for(double level : {0.5, 0.9, 0.99, 0.999, 1.0}) {
+		const size_t k = top_k<T>::needed(level, n);
+		top_k<T> tail(k);
+		for(size_t p = 0 ; p < parts ; p++) {
+			top_k<T> part(k);
+			for(size_t i = p ; i < n ; i += parts) part.push(all[i]);
+			tail.merge(part);
+		}
+		ok &= tail.count == n && tail.has(level) && !tail.has(level - 0.01)
+			&& tail.quantile(level) == sorted[size_t((n - 1) * level)];
+	}
+	cout << "tail quantiles " << (ok ? "exact" : "wrong") << endl;
+	return ok;
+}
+
+// test: the intervals of uniform samples contain the quantile at least 95 % of
+// the time, also in the far tail, and don't exist with too few samples there.
+bool check_interval() {
+	const size_t n = 400, trials = 4000;
+	size_t lo, hi;
+	bool ok = !top_k<T>::interval(0.99, 100, lo, hi);
+	for(double level : {0.5, 0.9, 0.99}) {
+		size_t covered = 0;
+		ok &= top_k<T>::interval(level, n, lo, hi);
+		vector<T> v(n);
+		for(size_t t = 0 ; t < trials ; t++) {
+			for(auto &x : v) x = T(rand()) / RAND_MAX;
+			sort(v.begin(), v.end());
+			covered += v[lo] <= level && level <= v[hi];
+		}
+		const double coverage = double(covered) / trials;
+		cout << "interval coverage at " << level << ' ' << coverage << endl;
+		ok &= coverage > 0.94 && coverage < 0.995;
+	}
+	return ok;
+}
+
+// test: tails come back from the cache under their key only, mapped in place;
+// the least recently used go first, with their lock files.
+bool check_cache() {
+	namespace fs = boost::filesystem;
+	const auto dir = fs::temp_directory_path() / fs::unique_path();
+	top_k<T> tail(3);
+	for(size_t i = 0 ; i < 10 ; i++) tail.push(T(i));
+	const auto values = tail.sorted();
+	const q_cache cache(dir);
+	{
+		q_cache::key_lock lock(cache, "a");
+		cache.store("a", tail);
+	}
+	q_cache::view<T> back;
+	q_cache::view<double> other;
+	bool ok = cache.load("a", back) && back.tail.count == 10 && back.tail.kept == 3
+		&& equal(values.begin(), values.end(), back.tail.values) && back.tail.quantile(0.9) == T(8);
+	ok &= !cache.load("b", back) && !cache.load("a", other) && fs::exists(cache.lock_file("a"));
+	const auto size = fs::file_size(cache.file("a"));
+	fs::last_write_time(cache.file("a"), std::time(nullptr) - 10);
+	const q_cache small(dir, size + 1);
+	small.store("b", tail);
+	ok &= !fs::exists(cache.file("a")) && !fs::exists(cache.lock_file("a")) && small.load("b", back);
+	fs::remove_all(dir);
+	cout << "cache " << (ok ? "ok" : "wrong") << endl;
+	return ok;
+}
+
+int main(int, char **) {
+	bool ok = check_philox();
+	ok &= check_normal();
+	ok &= check_top_k();
+	ok &= check_interval();
+	ok &= check_cache();
+	ok &= check_cached_steps();
+	ok &= check_seed();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,126 @@
+#include "chambolle_pock.h"
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+// every allocation with new.
+static atomic<size_t> allocations{0};
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t n) {
+	allocations++;
+	if(void *p = malloc(n ? n : 1)) return p;
+	throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+typedef float T;
+typedef boost::multi_array<T, 2> A;
+
+// test: after the first steps, the solver doesn't allocate.
+bool check(const string &name, params<T> p) {
+	p.force_q = 1;
+	p.input_stddev = 1;
+	p.tolerance = 0;
+	p.max_steps = 20;
+	A Y(p.size);
+	for(auto r : Y) for(auto &v : r) v = 2.0 * rand() / RAND_MAX - 1;
+	auto r = p.runner();
+	size_t first = 0, steady = 0;
+	r->current_cb = [&](const A &, size_t n) {
+		if(n == 2) first = allocations;
+		if(n + 1 == p.max_steps) steady = allocations - first;
+		return true;
+	};
+	r->run(Y);
+	cout << name << " allocations in steady state " << steady << endl;
+	return steady == 0;
+}
+
+// test: runner() refuses the parameters.
+bool rejected(const string &name, const params<T> &p) {
+	try {
+		p.runner();
+	} catch(const invalid_argument &) {
+		cout << name << " rejected" << endl;
+		return true;
+	}
+	cout << name << " not rejected" << endl;
+	return false;
+}
+
+// test: the calls of a solver step don't allocate either once repeated,
+// for convolvers the solver only uses inside hybrid_convolver.
+template<class Conv>
+bool check_steps(const string &name) {
+	typedef boost::multi_array<T, 3> B;
+	const size2_t s{{96, 80}};
+	Conv c(s);
+	c.use_workspace(make_shared<workspace>());
+	vector<shared_ptr<prepared_kernel>> ks, adj_ks;
+	for(size_t h : {1, 2, 5, 9}) {
+		ks.push_back(c.prepare_kernel(h, false));
+		adj_ks.push_back(c.prepare_kernel(h, true));
+	}
+	A x(s), w(s);
+	for(auto r : x) for(auto &v : r) v = 2.0 * rand() / RAND_MAX - 1;
+	B ys(boost::extents[ks.size()][s[0]][s[1]]), k_x(ys);
+	shared_ptr<prepared_image> f_x;
+	vector<shared_ptr<prepared_image>> f_ys;
+	const typename cpu_convolver<T>::row_update update = [&](size_t, size_t, T *y, const T *k) {
+		for(size_t i1 = 0 ; i1 < s[1] ; i1++) y[i1] = max(T(-1), min(T(1), y[i1] + k[i1]));
+	};
+	size_t first = 0;
+	for(size_t n = 0 ; n < 20 ; n++) {
+		if(n == 2) first = allocations;
+		c.prepare_image_into(x, f_x);
+		c.conv_all(*f_x, ks, k_x);
+		c.prepare_images_into(ys, k_x, f_ys);
+		c.conv_sum(f_ys, adj_ks, w);
+		c.dual_update(x, ks, adj_ks, ys, update, w);
+	}
+	const size_t steady = allocations - first;
+	cout << name << " allocations in steady state " << steady << endl;
+	return steady == 0;
+}
+
+int main(int, char **) {
+	params<T> p({{96, 80}}, {1, 2, 5, 9});
+	bool ok = check("fft", p);
+	p.fft_in_place = true;
+	ok &= check("fft in place", p);
+	p.fft_in_place = false;
+	p.fft_pad = true;
+	p.size = {{97, 83}};
+	ok &= check("fft padded", p);
+	p.fft_pad = false;
+	p.use_fft = false;
+	ok &= check("sat", p);
+	p.stream_dual = true;
+	ok &= check("sat streamed", p);
+	p.use_separable = true;
+	ok &= rejected("separable streamed", p);
+	p.stream_dual = false;
+	ok &= check("separable", p);
+	p.use_separable = false;
+	p.use_fft = true;
+	p.fft_tile = 64;
+	ok &= check("tiled", p);
+	p.fft_tile = 0;
+	p.stream_dual = true;
+	ok &= rejected("fft streamed", p);
+	p.stream_dual = false;
+	p.use_hybrid = true;
+	ok &= check("hybrid", p);
+	ok &= check_steps<cpu_direct_box_convolver<T>>("direct");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
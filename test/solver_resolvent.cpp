@@ -0,0 +1,35 @@
+#include "chambolle_pock.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+typedef float T;
+typedef boost::multi_array<T, 2> A;
+
+// test: the solver specialized for the resolvent gives the generic result.
+bool check(const string &name, params<T> p, T tolerance) {
+	p.force_q = 1;
+	p.input_stddev = 1;
+	p.tolerance = 0;
+	p.max_steps = 30;
+	A Y(p.size);
+	for(auto r : Y) for(auto &v : r) v = 2.0 * rand() / RAND_MAX - 1;
+	const A special = p.runner()->run(Y);
+	const A generic = chambolle_pock_cpu<T>(p).run(Y);
+	T err = 0;
+	for(size_t i0 = 0 ; i0 < p.size[0] ; i0++)
+		for(size_t i1 = 0 ; i1 < p.size[1] ; i1++)
+			err = max(err, abs(special[i0][i1] - generic[i0][i1]));
+	cout << name << " difference " << err << endl;
+	return err <= tolerance;
+}
+
+int main(int, char **) {
+	params<T> p({{64, 48}}, {1, 3, 7});
+	p.resolvent = make_shared<resolvent_l2_params<T>>();
+	bool ok = check("L2", p, 0);
+	p.resolvent = make_shared<resolvent_h1_params<T>>(0.5);
+	ok &= check("H1", p, 1e-4);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}